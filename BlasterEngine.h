@@ -0,0 +1,168 @@
+// Blaster protocol interpreter
+//
+// BlasterEngine holds the protocol state that carries over from one received
+// packet to the next, and interprets the command and data bytes. Everything it
+// does outside itself goes through three policy classes of static functions,
+// so each call is resolved at compile time and inlined. The Teensy sketch
+// supplies port register access and USB transmit buffers; a host build can
+// supply mocks and run the same source.
+//
+//   Pins       void write (uint8_t uPins)    Set the outputs, BITS_PORT of uPins
+//              uint8_t read (void)           Sample the inputs, BIT_TDO and BIT_ASO
+//              uint8_t pulse (uint8_t uPins, bool bRead)
+//                                            Set the outputs to uPins, which has TCK low,
+//                                            sample the inputs if bRead, then raise TCK.
+//                                            Returns the sample.
+//              void led (bool bOn)           Show the BIT_ACT bit of the bit bang commands
+//
+//   Transport  bool stop (void)              True to abandon the packet, as for a reset
+//              bool ready (void)             True if there is room for the next read
+//                                            result. If not, process() stops there.
+//              void send (uint8_t u)         Queue a read result
+//              int shift (const uint8_t *pSend, int nByte, uint8_t uShift)
+//                                            Shift up to nByte data bytes in mode uShift,
+//                                            queueing any results. Returns how many, 0
+//                                            only if the results had nowhere to go and
+//                                            stop() is now true.
+//
+//   Trace      void command (uint8_t u)      Each command byte
+//              void sequence (int i, uint8_t u, int nSeq, uint8_t uPort, bool bRead)
+//              void bang (int i, uint8_t u)
+//              void shifted (int nRun)       Each byte run shifted
+//
+// BlasterNoTrace does nothing, so tracing costs nothing unless it is wanted.
+
+#ifndef _BlasterEngine_h_
+#define _BlasterEngine_h_
+
+#include <stdint.h>
+
+// Blaster input bits
+#define BIT_TDO     0x01
+#define BIT_ASO     0x02
+
+// Blaster output bits
+#define BIT_TCK     0x01
+#define BIT_TMS     0x02
+#define BIT_NCE     0x04
+#define BIT_NCS     0x08
+#define BIT_TDI     0x10
+#define BIT_ACT     0x20
+#define BITS_PORT   0x1F
+
+// Protocol bits
+#define BIT_RD      0x40
+#define BIT_SEQ     0x80
+#define BITS_CNT    0x3F
+
+// Byte shift modes
+#define SHIFT_WRITE 0       // Write only
+#define SHIFT_TDO   1       // Write and read TDO (JTAG)
+#define SHIFT_ASO   2       // Write and read ASO (Active Serial)
+
+struct BlasterNoTrace
+{
+  static inline void command (uint8_t) {}
+  static inline void sequence (int, uint8_t, int, uint8_t, bool) {}
+  static inline void bang (int, uint8_t) {}
+  static inline void shifted (int) {}
+};
+
+template <class Pins, class Transport, class Trace = BlasterNoTrace>
+class BlasterEngine
+{
+public:
+  uint8_t uPort = BIT_TMS | BIT_TDI | BIT_NCE | BIT_NCS;  // Outputs as last set
+  uint8_t uShift = SHIFT_WRITE;   // Mode of the byte run in progress
+  int nSeq = 0;                   // Data bytes left in the byte run
+  bool bRead = false;             // The last command reads
+  bool bAct = false;              // BIT_ACT as last shown by Pins::led()
+
+  // Forget any command in progress, as after a reset or purge
+  void reset (void)
+  {
+    nSeq = 0;
+    bRead = false;
+  }
+
+  // Interpret pBuf[i] to pBuf[nLen - 1], returning the index reached. That is
+  // short of nLen if Transport::stop() or if a read result has nowhere to go,
+  // in which case call again from there to carry on.
+  int process (const uint8_t *pBuf, int i, int nLen)
+  {
+    bool bShow = bAct;
+    while (i < nLen)
+    {
+      if ( Transport::stop () ) break;
+      // A bit bang command with TCK low followed by the same with TCK high is a
+      // TCK pulse, as used to step between TAP states. Only the second may read.
+      bool bPulse = ( nSeq == 0 ) && ( i + 1 < nLen ) && (( pBuf[i] & ( BIT_SEQ | BIT_RD | BIT_TCK )) == 0 )
+        && (( pBuf[i + 1] & ~ BIT_RD ) == ( pBuf[i] | BIT_TCK ));
+      uint8_t uNext = pBuf[bPulse ? i + 1 : i];
+      // Wait for a transmit buffer without holding up the rest of the program
+      if (( nSeq > 0 ) ? ( uShift != SHIFT_WRITE ) : (( uNext & ( BIT_SEQ | BIT_RD )) == BIT_RD ))
+      {
+        if ( ! Transport::ready () ) break;
+      }
+      if ( bPulse )
+      {
+        Trace::command (pBuf[i]);
+        Trace::bang (i, pBuf[i]);
+        Trace::command (uNext);
+        Trace::bang (i + 1, uNext);
+        bShow = uNext & BIT_ACT;
+        bRead = uNext & BIT_RD;
+        uint8_t uIn = Pins::pulse (pBuf[i] & BITS_PORT, bRead);
+        if ( bRead ) Transport::send (uIn);
+        uPort = uNext & BITS_PORT;
+        i += 2;
+      }
+      else if ( nSeq > 0 )
+      {
+        int nRun = nLen - i;
+        if ( nRun > nSeq ) nRun = nSeq;
+        nRun = Transport::shift (&pBuf[i], nRun, uShift);
+        if ( nRun == 0 ) break;
+        // Leave TDI as the last bit sent
+        if ( pBuf[i + nRun - 1] & 0x80 ) uPort |= BIT_TDI;
+        else uPort &= ~ BIT_TDI;
+        Trace::shifted (nRun);
+        nSeq -= nRun;
+        i += nRun;
+      }
+      else
+      {
+        uint8_t u = pBuf[i];
+        Trace::command (u);
+        bRead = u & BIT_RD;
+        if ( u & BIT_SEQ )
+        {
+          nSeq = u & BITS_CNT;
+          uPort &= ~ BIT_TCK;
+          if ( ! bRead ) uShift = SHIFT_WRITE;
+          else if ( uPort & BIT_NCS ) uShift = SHIFT_TDO;
+          else uShift = SHIFT_ASO;
+          Trace::sequence (i, u, nSeq, uPort, bRead);
+        }
+        else
+        {
+          Trace::bang (i, u);
+          bShow = u & BIT_ACT;
+          uPort = u & BITS_PORT;
+          if ( bRead ) Transport::send (Pins::read ());
+          Pins::write (uPort);
+        }
+        ++i;
+      }
+    }
+    // Show the activity bit once for all the commands processed
+    if ( bShow != bAct )
+    {
+      bAct = bShow;
+      Pins::led (bAct);
+    }
+    return i;
+  }
+};
+
+#endif
@@ -1,58 +1,263 @@
 #include "usb_dev.h"
 #include "eeprom.h"
+#include "pinmap.h"
+#include "BlasterEngine.h"
 #include "HardwareSerial.h"
+#include <SPI.h>
 
 #define DEBUG       0
 #define SHOW_LED    1
+#define STATS       0       // Report command, byte and GPIO rates every 10 seconds
+#define SPI_SHIFT   0       // Use the SPI0 peripheral for byte shift runs
+#define SPI_CLOCK   4000000 // SPI clock (Hz) for byte shift runs
+#define SPI_MIN_RUN 4       // Shortest byte shift run to send using SPI
+#define DMA_SHIFT   0       // Use PIT paced DMA to clock byte shift runs
+#define DMA_TCK     2000000 // TCK frequency (Hz) for DMA byte shift runs
+#define DMA_MIN_RUN 8       // Shortest byte shift run to send using DMA
+#define IN_PLACE    1       // Return read results in the received packet where possible
+#define IRQ_PROCESS 0       // Process received packets from a software interrupt
+#define IRQ_PRIO    208     // Priority of the software interrupt, below USB (112)
+#define RX_BATCH    8       // Most received packets taken from the queue per poll
+#define TX_PREFETCH 2       // Transmit buffers allocated ahead of need
+
+#if DMA_SHIFT
+#include <DMAChannel.h>
+#endif
 
 // GPIO Pins
-#define PIN_TCK     0
-#define PIN_TMS     1
-#define PIN_NCE     2
-#define PIN_NCS     3
-#define PIN_TDI     4
-#define PIN_TDO     5
-#define PIN_ASO     6
-#define PIN_CNT     7
-#define PIN_LED     13
-
-// Blaster input bits
-#define BIT_TDO     0x01
-#define BIT_ASO     0x02
-
-// Blaster output bits
-#define BIT_TCK     0x01
-#define BIT_TMS     0x02
-#define BIT_NCE     0x04
-#define BIT_NCS     0x08
-#define BIT_TDI     0x10
-#define BIT_ACT     0x20
-#define BITS_PORT   0x1F
-
-// Protocol bits
-#define BIT_RD      0x40
-#define BIT_SEQ     0x80
-#define BITS_CNT    0x3F
-
-#define SEND_INT    10      // Time (miliseconds) between empty packets
+// All the JTAG outputs must be on one GPIO port, and both inputs on one port
+constexpr int PIN_TCK = 14;     // PTD1
+constexpr int PIN_TMS = 2;      // PTD0
+constexpr int PIN_NCE = 6;      // PTD4
+constexpr int PIN_NCS = 20;     // PTD5
+constexpr int PIN_TDI = 7;      // PTD2
+constexpr int PIN_TDO = 8;      // PTD3
+constexpr int PIN_ASO = 21;     // PTD6
+constexpr int PIN_LED = 13;
+
+// GPIO ports and bit masks for the JTAG pins
+static_assert ((PIN_TCK < NUM_MAPPED_PINS) && (PIN_TMS < NUM_MAPPED_PINS)
+  && (PIN_NCE < NUM_MAPPED_PINS) && (PIN_NCS < NUM_MAPPED_PINS) && (PIN_TDI < NUM_MAPPED_PINS)
+  && (PIN_TDO < NUM_MAPPED_PINS) && (PIN_ASO < NUM_MAPPED_PINS), "JTAG pin not in pin map");
+constexpr int PORT_OUT = pin_port (PIN_TCK);
+constexpr int PORT_IN = pin_port (PIN_TDO);
+static_assert ((pin_port (PIN_TMS) == PORT_OUT) && (pin_port (PIN_NCE) == PORT_OUT)
+  && (pin_port (PIN_NCS) == PORT_OUT) && (pin_port (PIN_TDI) == PORT_OUT),
+  "JTAG output pins must all be on the same GPIO port");
+static_assert (pin_port (PIN_ASO) == PORT_IN, "JTAG input pins must be on the same GPIO port");
+
+constexpr uint32_t MASK_TCK = pin_mask (PIN_TCK);
+constexpr uint32_t MASK_TMS = pin_mask (PIN_TMS);
+constexpr uint32_t MASK_NCE = pin_mask (PIN_NCE);
+constexpr uint32_t MASK_NCS = pin_mask (PIN_NCS);
+constexpr uint32_t MASK_TDI = pin_mask (PIN_TDI);
+constexpr uint32_t MASK_TDO = pin_mask (PIN_TDO);
+constexpr uint32_t MASK_ASO = pin_mask (PIN_ASO);
+constexpr uint32_t MASK_OUT = MASK_TCK | MASK_TMS | MASK_NCE | MASK_NCS | MASK_TDI;
+
+#if SPI_SHIFT
+// SPI0 uses the alternate pins for SCK, SOUT and SIN
+static_assert ((PIN_TCK == 14) && (PIN_TDI == 7) && (PIN_TDO == 8),
+  "SPI shift requires TCK on pin 14, TDI on pin 7 and TDO on pin 8");
+// With TCK high the first byte of a run goes by GPIO, so SPI must still have one
+static_assert (SPI_MIN_RUN >= 2, "SPI_MIN_RUN must be at least 2");
+#endif
+
+#if DMA_SHIFT
+static_assert (! SPI_SHIFT, "SPI_SHIFT and DMA_SHIFT cannot both be used");
+// The DMA transfers are single bytes to and from the low byte of the port registers
+static_assert ((MASK_OUT < 0x100) && (MASK_TDO < 0x100) && (MASK_ASO < 0x100),
+  "DMA shift requires the JTAG pins on port bits 0 - 7");
+#endif
+
+// Convert Blaster output bits to GPIO port bits
+constexpr uint32_t port_bits (uint8_t uPins)
+{
+  return (( uPins & BIT_TCK ) ? MASK_TCK : 0) | (( uPins & BIT_TMS ) ? MASK_TMS : 0)
+    | (( uPins & BIT_NCE ) ? MASK_NCE : 0) | (( uPins & BIT_NCS ) ? MASK_NCS : 0)
+    | (( uPins & BIT_TDI ) ? MASK_TDI : 0);
+}
+
+static constexpr uint32_t uPortBits[BITS_PORT + 1] = {
+  port_bits (0x00), port_bits (0x01), port_bits (0x02), port_bits (0x03),
+  port_bits (0x04), port_bits (0x05), port_bits (0x06), port_bits (0x07),
+  port_bits (0x08), port_bits (0x09), port_bits (0x0A), port_bits (0x0B),
+  port_bits (0x0C), port_bits (0x0D), port_bits (0x0E), port_bits (0x0F),
+  port_bits (0x10), port_bits (0x11), port_bits (0x12), port_bits (0x13),
+  port_bits (0x14), port_bits (0x15), port_bits (0x16), port_bits (0x17),
+  port_bits (0x18), port_bits (0x19), port_bits (0x1A), port_bits (0x1B),
+  port_bits (0x1C), port_bits (0x1D), port_bits (0x1E), port_bits (0x1F),
+};
 
 #if MEM_DEBUG > 0
 static const usb_packet_t *pbase = NULL;
 #endif
 static usb_packet_t *ptx = NULL;
-static uint8_t uPort = BIT_TMS | BIT_TDI | BIT_NCE | BIT_NCS;
-static uint8_t uRead = 0;
-static int nSeq = 0;
-static int bRead = 0;
+static usb_packet_t *ptxq[RX_BATCH];    // Full transmit buffers waiting for blaster_submit()
+static int nTxq = 0;
+static usb_packet_t *ptxPre[TX_PREFETCH]; // Empty transmit buffers from blaster_prefetch()
+static int nTxPre = 0;
+static usb_packet_t *prxq[RX_BATCH];    // Received packets taken by blaster_poll()
+static int nRxq = 0;
+static int iRxq = 0;                    // Next in prxq to process, perhaps part done
+#ifdef USB_POOL
+static usb_packet_t txStatus;           // Empty packet, never taken from or freed to a pool
+#endif
+static volatile bool bTxBusy = false;   // ptx is being used outside blaster_flush()
+static volatile bool bReset = false;    // The USB watchdog has fired or the host has purged
+#if IN_PLACE
+static usb_packet_t *prw = NULL;        // Received packet holding read results in place
+static int nInPlace = 0;                // Number of read results in prw
+#endif
 static uint32_t tNext = 0;
+// TCK pacing, set by the host with vendor request 0xA0
+static volatile uint32_t nHalf = 0;     // CPU cycles per half TCK period, 0 for full speed
+static uint32_t tClock = 0;             // Cycle count at the last JTAG output change
+#if SPI_SHIFT
+static volatile uint32_t uSpiClock = SPI_CLOCK;
+#endif
+#if DMA_SHIFT
+static volatile uint32_t uDmaLoad = F_BUS / ( 2 * DMA_TCK ) - 1;    // PIT reload value
+#endif
 #if DEBUG > 0
 int tShow;
 #endif
+#if STATS > 0
+static uint32_t nCmd = 0;       // Command bytes processed
+static uint32_t nByte = 0;      // Bytes shifted in byte mode
+static uint32_t nBang = 0;      // Bit bang commands
+static uint32_t nGpio = 0;      // GPIO operations
+static uint32_t tStats = 0;
+#define STATS_ADD(n, v)   n += v
+#else
+#define STATS_ADD(n, v)
+#endif
 
 #if DEBUG > 1
 static const char *psBits[] = {"TCK", "TMS", "NCE", "NCS", "TDI", "ACT", "RD ", "SEQ"};
 #endif
 
+#if DMA_SHIFT
+// DMA byte shift engine
+// The PIT channel with the same number as the capture DMA channel requests a
+// transfer every half TCK period. Each transfer samples the input port, then
+// the minor loop link writes the next byte of the output waveform. Per bit the
+// waveform has TCK low with the TDI bit, then TCK high, with a final write to
+// leave TCK low. The linked CITER count is only 9 bits, which limits a run to
+// 31 bytes (497 transfers).
+#define DMA_MAX_RUN 31
+#define DMA_BUF_LEN (16 * DMA_MAX_RUN + 1)
+
+static DMAChannel dmaCap;               // PIT triggered, samples the input port
+static DMAChannel dmaOut;               // Linked from dmaCap, writes the output port
+static uint8_t uDmaOut[2][DMA_BUF_LEN]; // Output waveforms
+static uint8_t uDmaCap[2][DMA_BUF_LEN]; // Input samples
+static int iDmaBuf = 0;                 // Buffer pair for the next run
+static bool bDmaInit = false;           // DMA and PIT channels available
+static bool bDmaBusy = false;           // Run in progress
+static const uint8_t *pDmaCap = NULL;   // Samples for the run in progress
+static uint8_t *pDmaRecv = NULL;        // Destination for results of a read run
+static int nDmaRecv = 0;
+static uint8_t uDmaMask = 0;            // Input sampled by a read run
+
+// Expand nByte data bytes into the output waveform, returning its length
+int dma_expand (const uint8_t *pSend, int nByte, uint8_t uBase, uint8_t *pOut)
+{
+  uint8_t *pEnd = pOut;
+  uint8_t uOut = uBase;
+  while ( nByte-- > 0 )
+  {
+    uint32_t uSend = *(pSend++);
+    for (int j = 0; j < 8; ++j)
+    {
+      uOut = uBase | (( uSend & 0x01 ) << pin_bit (PIN_TDI));
+      *(pEnd++) = uOut;
+      *(pEnd++) = uOut | MASK_TCK;
+      uSend >>= 1;
+    }
+  }
+  *(pEnd++) = uOut;
+  return pEnd - pOut;
+}
+
+// Extract the results of a read run from the input samples. As for the GPIO
+// kernels, the first bit is sampled before any output changes, and each later
+// bit while TCK is low, just before the rising edge.
+void dma_unpack (const uint8_t *pCap, uint8_t *pRecv, int nByte, uint8_t uMask)
+{
+  int iCap = 0;
+  while ( nByte-- > 0 )
+  {
+    uint32_t uRecv = 0;
+    for (int j = 0; j < 8; ++j)
+    {
+      uRecv >>= 1;
+      if ( pCap[iCap] & uMask ) uRecv |= 0x80;
+      iCap = ( iCap == 0 ) ? 3 : iCap + 2;
+    }
+    *(pRecv++) = uRecv;
+  }
+}
+
+void dma_init (void)
+{
+  // Periodic triggering is only available on DMA channels 0 - 3
+  if ( dmaCap.channel >= 4 ) return;
+  SIM_SCGC6 |= SIM_SCGC6_PIT;
+  PIT_MCR = 0;
+  KINETISK_PIT_CHANNELS[dmaCap.channel].LDVAL = uDmaLoad;
+  KINETISK_PIT_CHANNELS[dmaCap.channel].TCTRL = PIT_TCTRL_TEN;
+  dmaCap.source (*(volatile uint8_t *)&GPIO_PDIR (PORT_IN));
+  dmaCap.disableOnCompletion ();
+  dmaOut.destination (*(volatile uint8_t *)&GPIO_PDOR (PORT_OUT));
+  volatile uint8_t *pMux = &DMAMUX0_CHCFG0 + dmaCap.channel;
+  *pMux = 0;
+  *pMux = DMAMUX_ENABLE | DMAMUX_TRIG | DMAMUX_SOURCE_ALWAYS0;
+  bDmaInit = true;
+}
+
+// Wait for any DMA run to finish, and store its results.
+// Must be called before any other access to the JTAG pins or transmit buffer.
+void dma_wait (void)
+{
+  if ( ! bDmaBusy ) return;
+  while ( ! dmaOut.complete () ) ;
+  dmaCap.clearComplete ();
+  dmaOut.clearComplete ();
+  if ( pDmaRecv != NULL ) dma_unpack (pDmaCap, pDmaRecv, nDmaRecv, uDmaMask);
+  bDmaBusy = false;
+}
+
+// Start a DMA byte shift run of up to DMA_MAX_RUN bytes. The waveform is
+// expanded while any previous run completes, and the results are stored by
+// dma_wait(). pRecv is NULL for write only runs.
+void shift_dma (const uint8_t *pSend, uint8_t *pRecv, int nByte, uint8_t uShift)
+{
+  uint8_t uBase = GPIO_PDOR (PORT_OUT) & ~ ( MASK_TCK | MASK_TDI );
+  int nXfer = dma_expand (pSend, nByte, uBase, uDmaOut[iDmaBuf]);
+  dma_wait ();
+  // A new reload value takes effect at the end of the current PIT period
+  KINETISK_PIT_CHANNELS[dmaCap.channel].LDVAL = uDmaLoad;
+  dmaCap.destinationBuffer (uDmaCap[iDmaBuf], nXfer);
+  dmaOut.sourceBuffer (uDmaOut[iDmaBuf], nXfer);
+  // The minor loop link does not fire on the last transfer, so also link on completion
+  dmaOut.triggerAtTransfersOf (dmaCap);
+  dmaOut.triggerAtCompletionOf (dmaCap);
+  pDmaCap = uDmaCap[iDmaBuf];
+  pDmaRecv = pRecv;
+  nDmaRecv = nByte;
+  uDmaMask = ( uShift == SHIFT_ASO ) ? MASK_ASO : MASK_TDO;
+  iDmaBuf ^= 1;
+  bDmaBusy = true;
+  STATS_ADD (nGpio, 2 * nXfer);
+  dmaCap.enable ();
+}
+#endif
+
+#if IRQ_PROCESS
+void blaster_isr (void);
+#endif
+
 void setup()
 {
   // Hardware serial for diagnostics
@@ -60,6 +265,14 @@ void setup()
   Serial2.begin (115200, SERIAL_8N1);
 //#endif
   
+#if SPI_SHIFT
+  // Initialise SPI. This claims the pins, which are then returned to GPIO below.
+  SPI.setSCK (PIN_TCK);
+  SPI.setMOSI (PIN_TDI);
+  SPI.setMISO (PIN_TDO);
+  SPI.begin ();
+#endif
+
   // Configure JTAG Pins
   pinMode (PIN_TCK, OUTPUT);
   digitalWrite (PIN_TCK, LOW);
@@ -78,11 +291,23 @@ void setup()
   pinMode (PIN_TDO, INPUT_PULLUP);
   pinMode (PIN_ASO, INPUT_PULLUP);
 
+  // Start the cycle counter used to pace TCK
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#if DMA_SHIFT
+  dma_init ();
+#endif
+
   // Initialise USB
 #if (DEBUG > 0) || (MEM_DEBUG > 0)
   Serial2.printf ("Initialise USB\r\n");
 #endif
   usb_init ();
+#if IRQ_PROCESS
+  attachInterruptVector (IRQ_SOFTWARE, blaster_isr);
+  NVIC_SET_PRIORITY (IRQ_SOFTWARE, IRQ_PRIO);
+  NVIC_ENABLE_IRQ (IRQ_SOFTWARE);
+#endif
 #if MEM_DEBUG > 0
   usb_mem_show();
   pbase = usb_mem_base ();
@@ -90,64 +315,191 @@ void setup()
 #endif
 
   // Initialise empty packet timeout
-  tNext = millis () + SEND_INT;
+  tNext = millis () + usb_latency_timer;
+#ifdef USB_POOL
+  txStatus.buf[0] = 0x31;
+  txStatus.buf[1] = 0x60;
+  txStatus.len = 2;
+#endif
+#if STATS > 0
+  tStats = millis ();
+#endif
 }
 
+// Wait until nWait CPU cycles after tFrom
+static inline void clock_wait (uint32_t tFrom, uint32_t nWait)
+{
+  while ( ARM_DWT_CYCCNT - tFrom < nWait ) ;
+}
+
+// Set the TCK frequency in kHz, or zero for the fastest possible.
+// Called from the USB interrupt for vendor request 0xA0.
+void blaster_clock (uint16_t freq)
+{
+  uint32_t uHz = 1000UL * freq;
+  nHalf = freq ? ( F_CPU + 2 * uHz - 1 ) / ( 2 * uHz ) : 0;
+#if SPI_SHIFT
+  uSpiClock = ( freq && ( uHz < SPI_CLOCK )) ? uHz : SPI_CLOCK;
+#endif
+#if DMA_SHIFT
+  uDmaLoad = (( freq && ( uHz < DMA_TCK )) ? ( F_BUS + 2 * uHz - 1 ) / ( 2 * uHz )
+    : F_BUS / ( 2 * DMA_TCK )) - 1;
+#endif
+}
+
+// Set all the JTAG outputs with a single port write.
+// If TCK is paced, successive writes are at least half a TCK period apart.
 void JTAG_WR (uint8_t uPins)
 {
-  digitalWrite (PIN_TMS, ( uPins & BIT_TMS ) ? HIGH : LOW);
-  digitalWrite (PIN_TDI, ( uPins & BIT_TDI ) ? HIGH : LOW);
-  digitalWrite (PIN_NCE, ( uPins & BIT_NCE ) ? HIGH : LOW);
-  digitalWrite (PIN_NCS, ( uPins & BIT_NCS ) ? HIGH : LOW);
-  digitalWrite (PIN_TCK, ( uPins & BIT_TCK ) ? HIGH : LOW);
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  if ( nHalf )
+  {
+    clock_wait (tClock, nHalf);
+    tClock = ARM_DWT_CYCCNT;
+  }
+  uint32_t uOld = GPIO_PDOR (PORT_OUT);
+  uint32_t uNew = ( uOld & ~ MASK_OUT ) | uPortBits[uPins & BITS_PORT];
+  STATS_ADD (nGpio, 1);
+  // If TCK rises while other outputs change, set those up first
+  if ( ( uNew & ~ uOld & MASK_TCK ) && ( ( uNew ^ uOld ) & ~ MASK_TCK ) )
+  {
+    GPIO_PDOR (PORT_OUT) = uNew & ~ MASK_TCK;
+    STATS_ADD (nGpio, 1);
+  }
+  GPIO_PDOR (PORT_OUT) = uNew;
 }
 
+// Sample both JTAG inputs with a single port read
 uint8_t JTAG_RD (void)
 {
-  uint8_t uPins = 0;
-  if ( digitalRead (PIN_TDO) ) uPins |= BIT_TDO;
-  if ( digitalRead (PIN_ASO) ) uPins |= BIT_ASO;
-  return uPins;
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  uint32_t uIn = GPIO_PDIR (PORT_IN);
+  STATS_ADD (nGpio, 1);
+  return (( uIn & MASK_TDO ) ? BIT_TDO : 0) | (( uIn & MASK_ASO ) ? BIT_ASO : 0);
 }
 
-uint8_t blaster_eeprom (uint16_t addr)
+// One TCK pulse from a pair of bit bang commands: set the JTAG outputs to uPins,
+// which has TCK low, sample the inputs if bRead, then raise TCK. Only the pins
+// that change are toggled, and TCK is raised on its own.
+uint8_t JTAG_PULSE (uint8_t uPins, bool bRead)
 {
-  return bEEPROM[addr];
+  uint8_t uIn = 0;
+  if ( nHalf )
+  {
+    // Paced, so leave the timing to JTAG_WR()
+    JTAG_WR (uPins);
+    if ( bRead ) uIn = JTAG_RD ();
+    JTAG_WR (uPins | BIT_TCK);
+    return uIn;
+  }
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  uint32_t uChange = ( GPIO_PDOR (PORT_OUT) ^ uPortBits[uPins & BITS_PORT] ) & MASK_OUT;
+  STATS_ADD (nGpio, 2);
+  if ( uChange )
+  {
+    GPIO_PTOR (PORT_OUT) = uChange;
+    STATS_ADD (nGpio, 1);
+  }
+  if ( bRead ) uIn = JTAG_RD ();
+  GPIO_PSOR (PORT_OUT) = MASK_TCK;
+  return uIn;
 }
 
-void blaster_flush (void)
+uint8_t blaster_eeprom (uint16_t addr)
 {
+  return bEEPROM[addr];
 }
 
-void blaster_alloc (void)
+// Allocate a buffer for the transmit endpoint, or return NULL if none is free
+usb_packet_t *blaster_malloc (void)
 {
-  if (ptx == NULL)
-  {
 #if MEM_DEBUG > 0
-    Serial2.printf ("Request allocation: ");
+  Serial2.printf ("Request allocation: ");
 #endif
 #ifdef USB_POOL
 #if MEM_DEBUG
-    ptx = usb_malloc (BLASTER_TX_EP, -1);
+  return usb_malloc (BLASTER_TX_EP, -1);
 #else
-    ptx = usb_malloc (BLASTER_TX_EP);
+  return usb_malloc (BLASTER_TX_EP);
 #endif
 #else
-    ptx = usb_malloc ();
+  return usb_malloc ();
 #endif
-    while (ptx == NULL)
-    {
-      yield ();
-#ifdef USB_POOL
-#if MEM_DEBUG
-      ptx = usb_malloc (BLASTER_TX_EP, -2);
+}
+
+// Top up the empty transmit buffers kept in hand, so that when a buffer fills
+// in the middle of a shift run the next one is taken from ptxPre rather than
+// the pool. Called at the end of blaster_poll() and by blaster_flush() at the
+// start of each frame, never while ptx is in use.
+void blaster_prefetch (void)
+{
+  while ( nTxPre < TX_PREFETCH )
+  {
+    usb_packet_t *p = blaster_malloc ();
+    if ( p == NULL ) break;
+    ptxPre[nTxPre++] = p;
+  }
+}
+
+// Called from the USB interrupt at the start of each frame. Sends any read
+// results waiting in ptx, unless it is in use or belongs to a session that
+// is being reset. While earlier packets are still queued the host is behind,
+// so sending part of a packet early would only add to the packets it reads.
+// Then replaces any transmit buffers blaster_process() has taken from ptxPre.
+void blaster_flush (void)
+{
+  if ( bTxBusy ) return;
+  if (( ! bReset ) && ( ptx != NULL ) && ( ptx->len > 2 )
+    && ( usb_tx_packet_count (BLASTER_TX_EP) == 0 ))
+  {
+#if DMA_SHIFT
+    // Results of a DMA run may still be due to be stored in the buffer
+    if ( bDmaBusy ) return;
+#endif
+    usb_tx (BLASTER_TX_EP, ptx);
+    ptx = NULL;
+  }
+  blaster_prefetch ();
+}
+
+// Release a packet that is not going to be sent
+void blaster_free (usb_packet_t *p)
+{
+#if MEM_DEBUG > 0
+  usb_free (p, 0);
 #else
-      ptx = usb_malloc (BLASTER_TX_EP);
+  usb_free (p);
 #endif
+}
+
+// Queue the transmit buffers filled while processing received packets in a
+// single call, so the endpoint is only started once
+void blaster_submit (void)
+{
+  if ( nTxq == 0 ) return;
+#ifdef USB_POOL
+  usb_tx_batch (BLASTER_TX_EP, ptxq, nTxq);
 #else
-      ptx = usb_malloc ();
+  for (int i = 0; i < nTxq; ++i) usb_tx (BLASTER_TX_EP, ptxq[i]);
 #endif
-    }
+  nTxq = 0;
+}
+
+// Set up the transmit buffer if there is none, without waiting for one.
+// Returns false if none is free, in which case blaster_process() pauses.
+bool blaster_try_alloc (void)
+{
+  if (ptx == NULL)
+  {
+    if ( nTxPre > 0 ) ptx = ptxPre[--nTxPre];
+    else ptx = blaster_malloc ();
+    if (ptx == NULL) return false;
 #if MEM_DEBUG > 0
     Serial2.printf ("ptx = %p (%d)\r\n", ptx, ptx - pbase);
     usb_mem_show();
@@ -156,10 +508,46 @@ void blaster_alloc (void)
     ptx->buf[1] = 0x60;
     ptx->len = 2;
   }
+  return true;
+}
+
+// Sleep until the next interrupt, unless there is already something to do:
+// a received packet, or a transmit buffer for a packet that is part done,
+// either freed to the pool or prefetched by blaster_flush() into ptxPre.
+// Interrupts are masked while checking, so one arriving just before the WFI
+// still wakes it. BASEPRI would not do, as the masked interrupts could not.
+// The USB start of frame and the millisecond tick wake it at least every 1ms.
+void blaster_idle (void)
+{
+  __disable_irq ();
+  bool bWait = ( usb_rx_byte_count (BLASTER_RX_EP) == 0 );
+#ifdef USB_POOL
+  if (( iRxq < nRxq ) && (( usb_mem_free (BLASTER_TX_EP) > 0 ) || ( nTxPre > 0 ))) bWait = false;
+#endif
+  if ( bWait ) asm volatile ("wfi");
+  __enable_irq ();
+}
+
+// Set up the transmit buffer for a read result. BlasterEngine calls
+// Transport::ready() before every command that reads, and blaster_ready() only
+// returns true once there is a transmit buffer or room in prw, so this never
+// has to wait. If it is ever called without one, the read result has nowhere to
+// go: returns false and has the sketch start again, as for a purge.
+bool blaster_alloc (void)
+{
+  if ( blaster_try_alloc () ) return true;
+#if DEBUG > 0
+  Serial2.printf ("blaster_alloc: no transmit buffer\r\n");
+#endif
+  bReset = true;
+  return false;
 }
 
 void blaster_tx (void)
 {
+#if DMA_SHIFT
+  dma_wait ();
+#endif
   if (ptx != NULL)
   {
 #if DEBUG > 0
@@ -167,128 +555,588 @@ void blaster_tx (void)
     for (int i = 0; i < ptx->len; ++i ) Serial2.printf (" %02X", ptx->buf[i]);
     Serial2.printf ("\r\n");
 #endif
-    usb_tx (BLASTER_TX_EP, ptx);
+    ptxq[nTxq++] = ptx;
     ptx = NULL;
+    if ( nTxq == RX_BATCH ) blaster_submit ();
   }
 }
 
+// Send the results waiting in ptx, or else an empty packet. The empty packet
+// is the static txStatus, so it takes no buffer from the pool, and it is only
+// sent when nothing else is waiting to go. Without the pools it needs a
+// buffer, and if none is free, packets are already waiting for the host.
+void blaster_status (void)
+{
+  if ( ptx != NULL ) blaster_tx ();
+#ifdef USB_POOL
+  else if ( nTxq == 0 ) usb_tx_status (BLASTER_TX_EP, &txStatus);
+#else
+  else if ( blaster_try_alloc () ) blaster_tx ();
+#endif
+}
+
+#if IN_PLACE
+// Move the read results written in place to a transmit buffer, when there is
+// no more room for them in the received packet. Returns false if there is none.
+bool inplace_spill (void)
+{
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  if ( ! blaster_alloc () ) return false;
+  memcpy (&ptx->buf[ptx->len], prw->buf, nInPlace);
+  ptx->len += nInPlace;
+  prw = NULL;
+  if ( ptx->len >= BLASTER_TX_SIZE ) blaster_tx ();
+  return true;
+}
+
+// Turn the received packet into the transmit buffer, moving the read results
+// up to make room for the header. Returns false if there are no results, in
+// which case the packet is still owned by the caller.
+bool inplace_finish (void)
+{
+  usb_packet_t *p = prw;
+  prw = NULL;
+  if ( nInPlace == 0 ) return false;
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  memmove (&p->buf[2], &p->buf[0], nInPlace);
+  p->buf[0] = 0x31;
+  p->buf[1] = 0x60;
+  p->len = nInPlace + 2;
+  ptx = p;
+  if ( ptx->len >= BLASTER_TX_SIZE ) blaster_tx ();
+  return true;
+}
+#endif
+
+// Make sure there is room for the next read result, so that blaster_send() and
+// blaster_shift() will not have to wait for a transmit buffer. Returns false if
+// none is free, in which case blaster_process() pauses.
+bool blaster_ready (void)
+{
+#if IN_PLACE
+  if ( prw != NULL )
+  {
+    if ( nInPlace < BLASTER_TX_SIZE - 2 ) return true;
+    if ( ! blaster_try_alloc () )
+    {
+      blaster_submit ();
+      if ( ! blaster_try_alloc () ) return false;
+    }
+    if ( ! inplace_spill () ) return false;
+  }
+#endif
+  if ( blaster_try_alloc () ) return true;
+  blaster_submit ();
+  return blaster_try_alloc ();
+}
+
 void blaster_send (uint8_t u)
 {
 #if DEBUG > 1
-  Serial2.printf ("Queue: %02X, nTxIn = %d, nTxOut =%d\r\n", u, nTxIn, nTxOut);
+  Serial2.printf ("Queue: %02X, nTxq = %d, nTxPre = %d\r\n", u, nTxq, nTxPre);
 #endif
-  if (ptx == NULL) blaster_alloc ();
+#if IN_PLACE
+  if ( prw != NULL )
+  {
+    if ( nInPlace < BLASTER_TX_SIZE - 2 )
+    {
+      prw->buf[nInPlace++] = u;
+      return;
+    }
+    if ( ! inplace_spill () ) return;
+  }
+#endif
+  if (( ptx == NULL ) && ! blaster_alloc ()) return;
   ptx->buf[ptx->len] = u;
   if (++ptx->len >= BLASTER_TX_SIZE) blaster_tx ();
 }
 
-void loop()
+#if STATS > 0
+// Report protocol rates since the last report
+void blaster_stats (void)
 {
-#if MEM_DEBUG > 0
-  if (millis() >= tShow )
+  uint32_t tNow = millis ();
+  uint32_t tSpan = tNow - tStats;
+  uint32_t nBits = 8 * nByte + nBang;
+  if ( tSpan == 0 ) return;
+  uint32_t nWait = nHalf;
+  Serial2.printf ("cmd/s = %lu, bytes/s = %lu, gpio/bit = %lu.%02lu, ",
+    1000UL * nCmd / tSpan, 1000UL * nByte / tSpan,
+    nBits ? nGpio / nBits : 0UL, nBits ? (100UL * nGpio / nBits) % 100 : 0UL);
+  if ( nWait ) Serial2.printf ("tck = %lu kHz\r\n", F_CPU / ( 2000UL * nWait ));
+  else Serial2.printf ("tck = max\r\n");
+#if USB_IRQ_TIMING > 0
+  // Longest time the USB routines held off usb_isr() and the lower priority interrupts
+  Serial2.printf ("usb masked = %lu cycles max\r\n", usb_irq_masked_max);
+  usb_irq_masked_max = 0;
+#endif
+  nCmd = 0;
+  nByte = 0;
+  nBang = 0;
+  nGpio = 0;
+  tStats = tNow;
+}
+#endif
+
+// Byte shift kernels
+// Each shifts nByte bytes out on TDI, low bit first, taking TCK high then low
+// for each bit. The first write takes TCK low if it is not already. The read
+// kernels also sample one input before each bit, accumulating the results
+// low bit first.
+
+void shift_write (const uint8_t *pSend, int nByte)
+{
+  uint32_t uBase = GPIO_PDOR (PORT_OUT) & ~ ( MASK_TCK | MASK_TDI );
+  STATS_ADD (nGpio, 24 * nByte + 1);
+  while ( nByte-- > 0 )
   {
-    Serial2.printf ("time = %d\r\n", millis() / 1000);
-    usb_mem_show();
-    tShow = millis() + 10000;
+    uint32_t uSend = *(pSend++);
+    for (int j = 0; j < 8; ++j)
+    {
+      uint32_t uOut = uBase | (( uSend & 0x01 ) << pin_bit (PIN_TDI));
+      GPIO_PDOR (PORT_OUT) = uOut;
+      GPIO_PDOR (PORT_OUT) = uOut | MASK_TCK;
+      GPIO_PDOR (PORT_OUT) = uOut;
+      uSend >>= 1;
+    }
+  }
+}
+
+template <uint32_t uMask>
+void shift_read (const uint8_t *pSend, uint8_t *pRecv, int nByte)
+{
+  uint32_t uBase = GPIO_PDOR (PORT_OUT) & ~ ( MASK_TCK | MASK_TDI );
+  STATS_ADD (nGpio, 32 * nByte + 1);
+  while ( nByte-- > 0 )
+  {
+    uint32_t uSend = *(pSend++);
+    uint32_t uRecv = 0;
+    for (int j = 0; j < 8; ++j)
+    {
+      uint32_t uOut = uBase | (( uSend & 0x01 ) << pin_bit (PIN_TDI));
+      uRecv >>= 1;
+      if ( GPIO_PDIR (PORT_IN) & uMask ) uRecv |= 0x80;
+      GPIO_PDOR (PORT_OUT) = uOut;
+      GPIO_PDOR (PORT_OUT) = uOut | MASK_TCK;
+      GPIO_PDOR (PORT_OUT) = uOut;
+      uSend >>= 1;
+    }
+    *(pRecv++) = uRecv;
+  }
+}
+
+// Byte shift kernel paced by the cycle counter, for a TCK frequency set by the
+// host. Each half period is timed from the start of the previous one, so TCK
+// never runs faster than requested and the duty cycle stays close to even. Samples
+// the input in uMask as the read kernels do, or nothing if uMask is zero.
+void shift_paced (const uint8_t *pSend, uint8_t *pRecv, int nByte, uint32_t uMask)
+{
+  uint32_t uBase = GPIO_PDOR (PORT_OUT) & ~ ( MASK_TCK | MASK_TDI );
+  uint32_t nWait = nHalf;
+  uint32_t tEdge;
+  STATS_ADD (nGpio, ( uMask ? 32 : 24 ) * nByte + 1);
+  clock_wait (tClock, nWait);
+  tEdge = ARM_DWT_CYCCNT;
+  while ( nByte-- > 0 )
+  {
+    uint32_t uSend = *(pSend++);
+    uint32_t uRecv = 0;
+    for (int j = 0; j < 8; ++j)
+    {
+      uint32_t uOut = uBase | (( uSend & 0x01 ) << pin_bit (PIN_TDI));
+      uRecv >>= 1;
+      if ( uMask && ( GPIO_PDIR (PORT_IN) & uMask )) uRecv |= 0x80;
+      GPIO_PDOR (PORT_OUT) = uOut;
+      clock_wait (tEdge, nWait);
+      tEdge = ARM_DWT_CYCCNT;
+      GPIO_PDOR (PORT_OUT) = uOut | MASK_TCK;
+      clock_wait (tEdge, nWait);
+      tEdge = ARM_DWT_CYCCNT;
+      GPIO_PDOR (PORT_OUT) = uOut;
+      uSend >>= 1;
+    }
+    if ( uMask ) *(pRecv++) = uRecv;
   }
+  tClock = tEdge;
+}
+
+#if SPI_SHIFT
+// Switch TCK, TDI and TDO to SPI0
+void spi_claim (void)
+{
+  PORT_PCR (PORT_OUT, pin_bit (PIN_TCK)) = PORT_PCR_DSE | PORT_PCR_MUX(2);
+  PORT_PCR (PORT_OUT, pin_bit (PIN_TDI)) = PORT_PCR_DSE | PORT_PCR_MUX(2);
+  PORT_PCR (PORT_IN, pin_bit (PIN_TDO)) = PORT_PCR_PE | PORT_PCR_PS | PORT_PCR_MUX(2);
+}
+
+// Return TCK, TDI and TDO to GPIO, with the same settings as pinMode()
+void spi_release (void)
+{
+  PORT_PCR (PORT_OUT, pin_bit (PIN_TCK)) = PORT_PCR_SRE | PORT_PCR_DSE | PORT_PCR_MUX(1);
+  PORT_PCR (PORT_OUT, pin_bit (PIN_TDI)) = PORT_PCR_SRE | PORT_PCR_DSE | PORT_PCR_MUX(1);
+  PORT_PCR (PORT_IN, pin_bit (PIN_TDO)) = PORT_PCR_PE | PORT_PCR_PS | PORT_PCR_MUX(1);
+}
+
+// Byte shift using SPI mode 0, LSB first. TCK must already be low. SPI samples
+// TDO on the rising edge, which gives the same result as the GPIO kernels
+// sampling it while TCK is low.
+void shift_spi (const uint8_t *pSend, uint8_t *pRecv, int nByte)
+{
+  spi_claim ();
+  SPI.beginTransaction (SPISettings (uSpiClock, LSBFIRST, SPI_MODE0));
+  SPI.transfer (pSend, pRecv, nByte);
+  SPI.endTransaction ();
+  // Set the GPIO outputs as the GPIO kernels would leave them
+  if ( pSend[nByte - 1] & 0x80 ) GPIO_PSOR (PORT_OUT) = MASK_TDI;
+  else GPIO_PCOR (PORT_OUT) = MASK_TDI;
+  GPIO_PCOR (PORT_OUT) = MASK_TCK;
+  spi_release ();
+}
 #endif
-  if (usb_configuration == 0) return;
-  
-  usb_packet_t *prx = usb_rx (BLASTER_RX_EP);
-  if ( prx != NULL )
+
+// Shift a run of bytes with the kernel for mode uShift.
+// pRecv is not used for write only runs.
+void shift_bytes (const uint8_t *pSend, uint8_t *pRecv, int nByte, uint8_t uShift)
+{
+#if SPI_SHIFT
+  // ASO is not on an SPI pin, so AS reads always use GPIO
+  if (( uShift != SHIFT_ASO ) && ( nByte >= SPI_MIN_RUN ))
+  {
+    // If TCK is high the first bit is sampled before the falling edge,
+    // which SPI cannot do, so clock the first byte by GPIO
+    if ( GPIO_PDOR (PORT_OUT) & MASK_TCK )
+    {
+      if ( uShift == SHIFT_WRITE ) shift_write (pSend, 1);
+      else shift_read<MASK_TDO> (pSend, pRecv++, 1);
+      ++pSend;
+      --nByte;
+    }
+    shift_spi (pSend, pRecv, nByte);
+    return;
+  }
+#endif
+#if DMA_SHIFT
+  if ( bDmaInit && ( nByte >= DMA_MIN_RUN ))
+  {
+    while ( nByte > 0 )
+    {
+      int nRun = ( nByte > DMA_MAX_RUN ) ? DMA_MAX_RUN : nByte;
+      shift_dma (pSend, pRecv, nRun, uShift);
+      pSend += nRun;
+      if ( pRecv != NULL ) pRecv += nRun;
+      nByte -= nRun;
+    }
+    return;
+  }
+  dma_wait ();
+#endif
+  if ( nHalf ) shift_paced (pSend, pRecv, nByte,
+    ( uShift == SHIFT_WRITE ) ? 0 : ( uShift == SHIFT_TDO ) ? MASK_TDO : MASK_ASO);
+  else if ( uShift == SHIFT_WRITE ) shift_write (pSend, nByte);
+  else if ( uShift == SHIFT_TDO ) shift_read<MASK_TDO> (pSend, pRecv, nByte);
+  else shift_read<MASK_ASO> (pSend, pRecv, nByte);
+}
+
+// Shift a run of data bytes from a received packet, returns the number shifted.
+// Read runs are limited to the space left in the transmit buffer.
+int blaster_shift (const uint8_t *pSend, int nByte, uint8_t uShift)
+{
+#if DEBUG > 1
+  Serial2.printf ("JTAG Send: %d bytes, uShift = %d\r\n", nByte, uShift);
+#endif
+  if ( uShift == SHIFT_WRITE )
+  {
+    shift_bytes (pSend, NULL, nByte, uShift);
+  }
+  else
+  {
+#if IN_PLACE
+    if (( prw != NULL ) && ( nInPlace >= BLASTER_TX_SIZE - 2 ) && ! inplace_spill ()) return 0;
+    if ( prw != NULL )
+    {
+      // The results are always behind the data, so each byte is sent before it is overwritten
+      if ( nByte > BLASTER_TX_SIZE - 2 - nInPlace ) nByte = BLASTER_TX_SIZE - 2 - nInPlace;
+      shift_bytes (pSend, &prw->buf[nInPlace], nByte, uShift);
+      nInPlace += nByte;
+    }
+    else
+#endif
+    {
+      if (( ptx == NULL ) && ! blaster_alloc ()) return 0;
+      if ( nByte > BLASTER_TX_SIZE - ptx->len ) nByte = BLASTER_TX_SIZE - ptx->len;
+      shift_bytes (pSend, &ptx->buf[ptx->len], nByte, uShift);
+      ptx->len += nByte;
+      if ( ptx->len >= BLASTER_TX_SIZE ) blaster_tx ();
+    }
+  }
+  return nByte;
+}
+
+// What the protocol engine drives: the JTAG port, the activity LED and the
+// USB transmit buffers
+struct TeensyPins
+{
+  static inline void write (uint8_t uPins) { JTAG_WR (uPins); }
+  static inline uint8_t read (void) { return JTAG_RD (); }
+  static inline uint8_t pulse (uint8_t uPins, bool bRead) { return JTAG_PULSE (uPins, bRead); }
+  static inline void led (bool bOn)
+  {
+#if SHOW_LED
+    digitalWrite (PIN_LED, bOn ? HIGH : LOW);
+    STATS_ADD (nGpio, 1);
+#endif
+  }
+};
+
+struct UsbTransport
+{
+  static inline bool stop (void) { return bReset; }
+  static inline bool ready (void) { return blaster_ready (); }
+  static inline void send (uint8_t u) { blaster_send (u); }
+  static inline int shift (const uint8_t *pSend, int nByte, uint8_t uShift)
+  {
+    return blaster_shift (pSend, nByte, uShift);
+  }
+};
+
+#if ( STATS > 0 ) || ( DEBUG > 1 )
+struct BlasterTrace
+{
+  static inline void command (uint8_t) { STATS_ADD (nCmd, 1); }
+#if DEBUG > 1
+  static inline void sequence (int i, uint8_t u, int nSeq, uint8_t uPort, bool bRead)
+  {
+    Serial2.printf ("prx->buf[%d] = %02X: nSeq = %d, uPort = %02X, bRead = %d\r\n",
+      i, u, nSeq, uPort, bRead);
+  }
+  static inline void bang (int i, uint8_t u)
+  {
+    Serial2.printf ("prx->buf[%d] = %02X:", i, u);
+    uint8_t uTmp = u;
+    for (int b = 0; b < 8; ++b)
+    {
+      if ( uTmp & 0x01 ) Serial2.printf (" %s", psBits[b]);
+      else Serial2.printf ("    ");
+      uTmp >>= 1;
+    }
+    Serial2.printf ("\r\n");
+    STATS_ADD (nBang, 1);
+  }
+#else
+  static inline void sequence (int, uint8_t, int, uint8_t, bool) {}
+  static inline void bang (int, uint8_t) { STATS_ADD (nBang, 1); }
+#endif
+#if STATS > 0
+  static inline void shifted (int nRun) { STATS_ADD (nByte, nRun); }
+#else
+  static inline void shifted (int) {}
+#endif
+};
+#else
+typedef BlasterNoTrace BlasterTrace;
+#endif
+
+static BlasterEngine<TeensyPins, UsbTransport, BlasterTrace> engine;
+
+#ifdef USB_WATCHDOG_MS
+// Called by the USB interrupt when the watchdog has freed the packets the
+// host stopped reading
+void blaster_watchdog (void)
+{
+  bReset = true;
+}
+#endif
+
+// Called by the USB interrupt for an FTDI reset or purge request, once it has
+// freed the packets waiting to be sent, or when the host configures the device
+// again with packets still waiting to be read
+void blaster_purge (void)
+{
+  bReset = true;
+}
+
+// Start again after the USB watchdog has fired or the host has purged.
+// Whatever has been received or is waiting to be sent belongs to the old
+// session, so drop it along with the protocol state. Only called from
+// blaster_poll().
+void blaster_reset (void)
+{
+  bReset = false;
+#if DMA_SHIFT
+  dma_wait ();
+#endif
+  engine.reset ();
+#if IN_PLACE
+  prw = NULL;
+  nInPlace = 0;
+#endif
+  if ( ptx != NULL ) ptx->len = 2;
+  while ( nTxq > 0 ) blaster_free (ptxq[--nTxq]);
+  while ( iRxq < nRxq ) blaster_free (prxq[iRxq++]);
+#ifdef USB_POOL
+  // After a purge, keeps anything the host has sent since
+  usb_rx_discard (BLASTER_RX_EP);
+#else
+  usb_packet_t *prx;
+  while ((prx = usb_rx (BLASTER_RX_EP)) != NULL) blaster_free (prx);
+#endif
+}
+
+// Interpret the commands and data in one received packet, starting from
+// prx->index. If a read result has nowhere to go it stops there, leaving
+// prx->index short of prx->len, and is called again later to carry on.
+// Returns true if the packet has been kept as the transmit buffer, in which
+// case it must not be freed.
+bool blaster_process (usb_packet_t *prx)
+{
+  int i = prx->index;
+#if IN_PLACE
+  // With no earlier results waiting, each read result can overwrite the
+  // command or data byte it came from, and the packet sent back as it is
+  if (( i == 0 ) && ( ptx == NULL ))
+  {
+    prw = prx;
+    nInPlace = 0;
+  }
+#endif
+  i = engine.process (prx->buf, i, prx->len);
+  prx->index = i;
+  if ( i < prx->len ) return false;
+#if IN_PLACE
+  if ( prw != NULL ) return inplace_finish ();
+#endif
+  return false;
+}
+
+// Process the received packets waiting in the queue, up to RX_BATCH of them,
+// or send an empty packet if none for the host's latency timer. The read
+// results are sent once the batch is done. If blaster_process() pauses for a
+// transmit buffer, the rest of the batch waits for the next call.
+// Returns true if there may be more packets to process straight away.
+bool blaster_poll (void)
+{
+  bTxBusy = true;
+  asm volatile ("" ::: "memory");
+  if ( bReset ) blaster_reset ();
+  if ( iRxq == nRxq )
+  {
+    iRxq = 0;
+#ifdef USB_POOL
+    nRxq = usb_rx_batch (BLASTER_RX_EP, prxq, RX_BATCH);
+#else
+    nRxq = 0;
+    while (( nRxq < RX_BATCH ) && (( prxq[nRxq] = usb_rx (BLASTER_RX_EP) ) != NULL )) ++nRxq;
+#endif
+  }
+  bool bBusy = ( nRxq > 0 );
+  bool bShort = false;
+  while ( iRxq < nRxq )
   {
+    usb_packet_t *prx = prxq[iRxq];
 #if MEM_DEBUG > 0
     Serial2.printf ("prx = %p (%d)\r\n", prx, prx - pbase);
     usb_mem_show();
 #endif
 #if DEBUG > 0
     Serial2.printf ("Recv:");
-    for (int i = 0; i < prx->len; ++i ) Serial2.printf (" %02X", prx->buf[i]);
+    for (int j = prx->index; j < prx->len; ++j ) Serial2.printf (" %02X", prx->buf[j]);
     Serial2.printf ("\r\n");
 #endif
-    
-    for (int i = 0; i < prx->len; ++i)
+    bShort = ( prx->len < 64 );
+    bool bKept = blaster_process (prx);
+    if ( bReset )
     {
-      if ( nSeq > 0 )
-      {
-        uint8_t uSend = prx->buf[i];
-        uint8_t uRecv = 0;
-#if DEBUG > 1
-        Serial2.printf ("JTAG Send: %02X, uPort = %02X, bRead = %d\r\n", uSend, uPort, bRead);
-#endif
-        for (int j = 0; j < 8; ++j)
-        {
-          if (bRead)
-          {
-            uRecv >>= 1;
-            if (JTAG_RD () & uRead) uRecv |= 0x80;
-          }
-          if ( uSend & 0x01 ) uPort |= BIT_TDI;
-          else uPort &= ~ BIT_TDI;
-          uPort &= ~ BIT_TCK;
-          JTAG_WR (uPort);
-          uPort |= BIT_TCK;
-          JTAG_WR (uPort);
-          uPort &= ~ BIT_TCK;
-          JTAG_WR (uPort);
-          uSend >>= 1;
-        }
-        if ( bRead ) blaster_send (uRecv);
-        --nSeq;
-      }
-      else
-      {
-        bRead = prx->buf[i] & BIT_RD;
-        if ( prx->buf[i] & BIT_SEQ )
-        {
-          nSeq = prx->buf[i] & BITS_CNT;
-          uPort &= ~ BIT_TCK;
-          if ( uPort & BIT_NCS ) uRead = BIT_TDO;
-          else uRead = BIT_ASO;
-#if DEBUG > 1
-          Serial2.printf ("prx->buf[%d] = %02X: nSeq = %d, uPort = %02X, bRead = %d\r\n",
-            i, prx->buf[i], nSeq, uPort, bRead);
-#endif
-        }
-        else
-        {
-#if DEBUG > 1
-          Serial2.printf ("prx->buf[%d] = %02X:", i, prx->buf[i]);
-          uint8_t uTmp = prx->buf[i];
-          for (int i = 0; i < 8; ++i)
-          {
-            if ( uTmp & 0x01 ) Serial2.printf (" %s", psBits[i]);
-            else Serial2.printf ("    ");
-            uTmp >>= 1;
-          }
-          Serial2.printf ("\r\n");
-#endif
-#if SHOW_LED
-          digitalWrite (PIN_LED, prx->buf[i] & BIT_ACT ? HIGH : LOW);
-#endif
-          uPort = prx->buf[i] & BITS_PORT;
-          if ( bRead ) blaster_send (JTAG_RD ());
-          JTAG_WR (uPort);
-        }
-      }
+      if ( ! bKept ) blaster_free (prx);
+      ++iRxq;
+      blaster_reset ();
+      bShort = false;
+      break;
     }
-    if (prx->len < 64)
+    // Paused until a transmit buffer is free
+    if (( ! bKept ) && ( prx->index < prx->len )) break;
+    if ( ! bKept ) blaster_free (prx);
+    ++iRxq;
+  }
+  if ( iRxq < nRxq )
+  {
+    bBusy = false;
+  }
+  else if ( bBusy )
+  {
+    // A short packet ends a transfer, so the host may be waiting for its
+    // results. Send them, or an empty packet if there are none, unless more
+    // commands have already arrived, or the host has still to read earlier
+    // packets, in which case blaster_flush() sends them once it has.
+    if ( bShort && ( usb_rx_byte_count (BLASTER_RX_EP) == 0 )
+      && ( usb_tx_packet_count (BLASTER_TX_EP) == 0 ))
     {
-      blaster_tx ();
-      blaster_alloc ();
-      blaster_tx ();
-      tNext = millis () + SEND_INT;
+      blaster_status ();
+      tNext = millis () + usb_latency_timer;
     }
-#if MEM_DEBUG > 0
-    usb_free (prx, 0);
-#else
-    usb_free (prx);
+  }
+  else
+  {
+#if DMA_SHIFT
+    // Nothing else to do, so collect any DMA results for blaster_flush()
+    dma_wait ();
 #endif
+    if (millis () >= tNext)
+    {
+      blaster_status ();
+      tNext = millis () + usb_latency_timer;
+    }
   }
-  else if (millis () >= tNext)
+  blaster_submit ();
+  blaster_prefetch ();
+  // Make sure ptx is up to date before blaster_flush() can use it
+  asm volatile ("" ::: "memory");
+  bTxBusy = false;
+  return bBusy;
+}
+
+#if IRQ_PROCESS
+// Called by the USB interrupt when a packet is received
+void blaster_rx_ready (void)
+{
+  NVIC_SET_PENDING (IRQ_SOFTWARE);
+}
+
+// Software interrupt, running below the USB interrupt so that transmit
+// buffers are still freed while it waits for one
+void blaster_isr (void)
+{
+  while ( blaster_poll () ) ;
+}
+#else
+void blaster_rx_ready (void)
+{
+}
+#endif
+
+void loop()
+{
+#if MEM_DEBUG > 0
+  if (millis() >= tShow )
   {
-    blaster_alloc ();
-    blaster_tx ();
-    tNext = millis () + SEND_INT;
+    Serial2.printf ("time = %d\r\n", millis() / 1000);
+    usb_mem_show();
+    tShow = millis() + 10000;
   }
+#endif
+#if STATS > 0
+  if (millis() - tStats >= 10000) blaster_stats ();
+#endif
+  if (usb_configuration == 0) return;
+#if IRQ_PROCESS
+  // Packets are processed by blaster_isr(). Just trigger it for the empty packets,
+  // or to carry on after pausing for a transmit buffer.
+  if (( millis () >= tNext ) || ( iRxq < nRxq )) NVIC_SET_PENDING (IRQ_SOFTWARE);
+  blaster_idle ();
+#else
+  if ( ! blaster_poll () ) blaster_idle ();
+#endif
 }
@@ -960,8 +960,17 @@ let me know?  http://forum.pjrc.com/forums/4-Suggestions-amp-Bug-Reports
   #define PRODUCT_SERIAL_LEN    8
   #define EP0_SIZE              8
   #define NUM_ENDPOINTS         2
-  #define NUM_USB_BUFFERS       24
-  #define USB_POOL              {4, 20}  // Buffers per endpoint. Must sum to no more than NUM_USB_BUFFERS
+  #ifndef USB_BLASTER_BUFFERS
+  #define USB_BLASTER_BUFFERS   24       // Set by the "USB Buffers" menu in boards.txt, up to 256
+  #endif
+  #define NUM_USB_BUFFERS       USB_BLASTER_BUFFERS
+  #ifndef USB_POOL                       // Both may be set instead, e.g. a fixed {4, 20} and 0
+  #define USB_POOL              {4, 4}   // Buffers reserved per endpoint. At least one each
+  #define USB_POOL_SHARED       (NUM_USB_BUFFERS - 8) // Buffers borrowed by either endpoint. Total no more than NUM_USB_BUFFERS
+  #endif
+  #define USB_WATCHDOG_MS       2000     // Free stale buffers after this long short of them with no transfers
+  #define USB_LATENCY_MS        10       // Empty packet interval until the host sets the latency timer
+  #define USB_RX_HOLD           8        // NAK the host while more packets than this wait to be sent
   #define NUM_INTERFACE         1
   #define USB_BLASTER_INTERFACE 0
   #define BM_ATTRIBUTES         0x80
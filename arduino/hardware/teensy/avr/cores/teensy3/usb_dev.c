@@ -69,11 +69,73 @@ typedef struct {
 __attribute__ ((section(".usbdescriptortable"), used))
 static bdt_t table[(NUM_ENDPOINTS+1)*4];
 
+#ifdef USB_POOL
+// Single producer, single consumer packet queues. Receive queues are filled by
+// usb_isr() and emptied by usb_rx(). Transmit queues are filled by usb_tx() and
+// emptied by usb_isr(), or by usb_tx() with usb_isr() masked. Each index and
+// byte total is only written by one side, so no locking is needed, and the
+// packet and byte counts are the difference between the totals in and out.
+// Only buffers from usb_malloc() are queued, so each slot holds a buffer index.
+#if NUM_USB_BUFFERS <= 32
+#define USB_QUEUE_SIZE  32      // Power of 2, at least NUM_USB_BUFFERS
+#elif NUM_USB_BUFFERS <= 64
+#define USB_QUEUE_SIZE  64
+#elif NUM_USB_BUFFERS <= 128
+#define USB_QUEUE_SIZE  128
+#else
+#define USB_QUEUE_SIZE  256
+#endif
+typedef struct {
+        volatile uint8_t slot[USB_QUEUE_SIZE];
+        volatile uint16_t head;         // Packets in, written by the producer
+        volatile uint16_t tail;         // Packets out, written by the consumer
+        volatile uint16_t bytes_in;
+        volatile uint16_t bytes_out;
+} usb_queue_t;
+static usb_queue_t rx_queue[NUM_ENDPOINTS];
+static usb_queue_t tx_queue[NUM_ENDPOINTS];
+// Packets kept by the caller of usb_tx_status(), which are never freed
+static usb_packet_t *tx_status[NUM_ENDPOINTS];
+
+#ifdef USB_RX_HOLD
+// Non-zero while the Blaster receive endpoint is held off, because more than
+// USB_RX_HOLD packets are waiting to be sent. Its empty buffer descriptors are
+// then left unarmed, so the host gets NAKs. iEP is zero based.
+int usb_rx_held(unsigned int iEP)
+{
+        usb_queue_t *q = &tx_queue[BLASTER_TX_EP - 1];
+        return (iEP == BLASTER_RX_EP - 1) && ((uint16_t)(q->head - q->tail) > USB_RX_HOLD);
+}
+#endif
+
+static inline void usb_queue_put(usb_queue_t *q, usb_packet_t *packet)
+{
+        uint16_t head = q->head;
+        q->slot[head & (USB_QUEUE_SIZE - 1)] = packet->iBuf;
+        q->bytes_in += packet->len;
+        // The packet must be complete before the consumer can see it
+        __asm__ volatile("" ::: "memory");
+        q->head = head + 1;
+}
+
+static inline usb_packet_t *usb_queue_get(usb_queue_t *q)
+{
+        uint16_t tail = q->tail;
+        usb_packet_t *packet;
+        if (tail == q->head) return NULL;
+        __asm__ volatile("" ::: "memory");
+        packet = USB_PACKET(q->slot[tail & (USB_QUEUE_SIZE - 1)]);
+        q->bytes_out += packet->len;
+        q->tail = tail + 1;
+        return packet;
+}
+#else
 static usb_packet_t *rx_first[NUM_ENDPOINTS];
 static usb_packet_t *rx_last[NUM_ENDPOINTS];
 static usb_packet_t *tx_first[NUM_ENDPOINTS];
 static usb_packet_t *tx_last[NUM_ENDPOINTS];
 uint16_t usb_rx_byte_count_data[NUM_ENDPOINTS];
+#endif
 
 static uint8_t tx_state[NUM_ENDPOINTS];
 #define TX_STATE_BOTH_FREE_EVEN_FIRST   0
@@ -163,6 +225,11 @@ uint8_t usb_rx_memory_needed = 0;
 volatile uint8_t usb_configuration = 0;
 volatile uint8_t usb_reboot_timer = 0;
 
+#if USB_IRQ_TIMING > 0 && (defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_7M__))
+uint32_t usb_irq_masked_at;
+volatile uint32_t usb_irq_masked_max;
+#endif
+
 #if MEM_DEBUG > 0
 void usb_queues(void)
     {
@@ -170,19 +237,17 @@ void usb_queues(void)
     for (int iEP = 0; iEP < NUM_ENDPOINTS; ++iEP)
         {
         UsbLog("EP %d TX Queue:", iEP+1);
-        usb_packet_t *p = tx_first[iEP];
-        while (p != NULL)
+        for (uint16_t i = tx_queue[iEP].tail; i != tx_queue[iEP].head; ++i)
             {
+            usb_packet_t *p = USB_PACKET(tx_queue[iEP].slot[i & (USB_QUEUE_SIZE - 1)]);
             UsbLog(" %d (%d)", p - pbase, p->len);
-            p = p->next;
             }
         UsbLog("\r\n");
         UsbLog("EP %d RX Queue:", iEP+1);
-        p = rx_first[iEP];
-        while (p != NULL)
+        for (uint16_t i = rx_queue[iEP].tail; i != rx_queue[iEP].head; ++i)
             {
+            usb_packet_t *p = USB_PACKET(rx_queue[iEP].slot[i & (USB_QUEUE_SIZE - 1)]);
             UsbLog(" %d (%d)", p - pbase, p->len);
-            p = p->next;
             }
         UsbLog("\r\n");
         }
@@ -218,6 +283,103 @@ static void endpoint0_transmit(const void *data, uint32_t len)
 }
 
 static uint8_t reply_buffer[8];
+#if defined(USB_BLASTER) && defined(USB_POOL)
+static usb_pool_stats_t pool_reply[NUM_ENDPOINTS + 1];
+#endif
+#ifdef USB_WATCHDOG_MS
+static uint32_t usb_tokens = 0;         // Transfers completed on endpoints other than 0
+static usb_watchdog_snapshot_t usb_watchdog_state;
+#endif
+#ifdef USB_BLASTER
+volatile uint8_t usb_latency_timer = USB_LATENCY_MS;
+#endif
+
+#ifdef USB_POOL
+// Receive queue position when the host last purged or the device was configured
+// again, with rx_purge set until usb_rx_discard() has dropped the packets before
+// it. usb_rx() and usb_rx_batch() stop at the mark. The receive queues have a
+// single consumer, so usb_isr() marks stale packets rather than taking them.
+static volatile uint16_t rx_purge_mark[NUM_ENDPOINTS];
+static volatile uint8_t rx_purge[NUM_ENDPOINTS];
+
+static void usb_rx_purge(int endpoint)
+{
+        rx_purge_mark[endpoint] = rx_queue[endpoint].head;
+        __asm__ volatile("" ::: "memory");
+        rx_purge[endpoint] = 1;
+}
+#endif
+
+#if defined(USB_BLASTER) && defined(USB_POOL)
+
+// Free the packets queued to be sent on an endpoint. Any already given to the SIE
+// are left to it: the host may be taking one now, so they are sent and freed as
+// usual when their transfers complete.
+static void usb_tx_drop(int endpoint)
+{
+        usb_packet_t *p;
+
+        while ((p = usb_queue_get(&tx_queue[endpoint])) != NULL) {
+#if MEM_DEBUG > 0
+                usb_free(p, __LINE__);
+#else
+                usb_free(p);
+#endif
+        }
+}
+
+// Free all the packets waiting to be sent on an endpoint, taking back the buffer
+// descriptors too. Only for when the SIE cannot be using them: the host has not
+// taken a packet for the watchdog time, or is configuring the device. The SIE will
+// use the oldest one next, so that must be the first one refilled.
+static void usb_tx_reclaim(int endpoint)
+{
+        bdt_t *b = &table[index(endpoint + 1, TX, EVEN)];
+        usb_packet_t *p;
+        int odd;
+
+        for (odd = 0; odd < 2; odd++) {
+                if (b[odd].desc & BDT_OWN) {
+                        b[odd].desc = 0;
+                        p = (usb_packet_t *)((uint8_t *)(b[odd].addr) - offsetof(usb_packet_t, buf));
+                        if (p == tx_status[endpoint]) continue;
+#if MEM_DEBUG > 0
+                        usb_free(p, __LINE__);
+#else
+                        usb_free(p);
+#endif
+                }
+        }
+        usb_tx_drop(endpoint);
+        switch (tx_state[endpoint]) {
+          case TX_STATE_ODD_FREE:
+          case TX_STATE_NONE_FREE_EVEN_FIRST:
+                tx_state[endpoint] = TX_STATE_BOTH_FREE_EVEN_FIRST;
+                break;
+          case TX_STATE_EVEN_FREE:
+          case TX_STATE_NONE_FREE_ODD_FIRST:
+                tx_state[endpoint] = TX_STATE_BOTH_FREE_ODD_FIRST;
+                break;
+          default:
+                break;
+        }
+}
+
+// FTDI reset and purge requests. Free the packets queued to be sent, leave the ones
+// received so far for usb_rx_discard() and have the sketch start again. Anything the
+// host sends after the request is kept. The host polls IN while it makes the
+// request, so up to two packets already given to the SIE may still reach it.
+static void usb_purge(void)
+{
+        int i;
+
+        for (i = 0; i < NUM_ENDPOINTS; i++) {
+                usb_rx_purge(i);
+                usb_tx_drop(i);
+        }
+        blaster_purge();
+}
+#endif
 
 static void usb_setup(void)
 {
@@ -229,6 +391,9 @@ static void usb_setup(void)
         uint8_t epconf;
         const uint8_t *cfg;
         int i;
+#ifdef USB_POOL
+        int rx_stale = 0;
+#endif
         // UsbLog ("Setup: 0x%04X\r\n", setup.wRequestAndType);
         switch (setup.wRequestAndType) {
           case 0x0500: // SET_ADDRESS
@@ -238,8 +403,17 @@ static void usb_setup(void)
                 usb_configuration = setup.wValue;
                 reg = &USB0_ENDPT1;
                 cfg = usb_endpoint_config_table;
+#ifdef USB_POOL
+                // The receive buffer descriptors are all set up again below, so a
+                // packet freed here must not be given to an empty one
+                for (i=0; i < NUM_ENDPOINTS; i++) usb_rx_memory_needed[i] = 0;
+#endif
                 // clear all BDT entries, free any allocated memory...
                 for (i=4; i < (NUM_ENDPOINTS+1)*4; i++) {
+#if defined(USB_BLASTER) && defined(USB_POOL)
+                        // usb_tx_reclaim() takes back the transmit ones below
+                        if (i & (TX << 1)) continue;
+#endif
                         if (table[i].desc & BDT_OWN) {
                                 usb_packet_t *p = (usb_packet_t *)((uint8_t *)(table[i].addr)
                                     - offsetof(usb_packet_t, buf));
@@ -252,6 +426,28 @@ static void usb_setup(void)
                 }
                 // free all queued packets
                 for (i=0; i < NUM_ENDPOINTS; i++) {
+#ifdef USB_POOL
+                        // Received packets belong to the consumer, which is told to
+                        // discard them. usb_isr() is the only transmit queue consumer.
+                        if (rx_queue[i].head != rx_queue[i].tail) {
+                                usb_rx_purge(i);
+                                rx_stale = 1;
+                        }
+#ifdef USB_BLASTER
+                        // Also keeps the usb_tx_status() packet, and the buffer
+                        // descriptor the SIE will use next
+                        usb_tx_reclaim(i);
+#else
+                        usb_packet_t *p;
+                        while ((p = usb_queue_get(&tx_queue[i])) != NULL) {
+#if MEM_DEBUG > 0
+                                usb_free(p, __LINE__);
+#else
+                                usb_free(p);
+#endif
+                        }
+#endif
+#else
                         usb_packet_t *p, *n;
                         p = rx_first[i];
                         while (p) {
@@ -278,6 +474,8 @@ static void usb_setup(void)
                         tx_first[i] = NULL;
                         tx_last[i] = NULL;
                         usb_rx_byte_count_data[i] = 0;
+#endif
+#if !defined(USB_BLASTER) || !defined(USB_POOL)
                         switch (tx_state[i]) {
                           case TX_STATE_EVEN_FREE:
                           case TX_STATE_NONE_FREE_EVEN_FIRST:
@@ -290,7 +488,11 @@ static void usb_setup(void)
                           default:
                                 break;
                         }
+#endif
                 }
+#if defined(USB_BLASTER) && defined(USB_POOL)
+                if (rx_stale) blaster_purge();
+#endif
 #ifndef USB_POOL
                 usb_rx_memory_needed = 0;
 #endif
@@ -328,6 +530,7 @@ static void usb_setup(void)
                                         table[index(i, RX, EVEN)].desc = 0;
 #ifdef USB_POOL
                                         ++usb_rx_memory_needed[i-1];
+                                        usb_mem_starved(i-1);
                                         // UsbLog("Request %d\r\n", i-1);
 #else
                                         ++usb_rx_memory_needed;
@@ -350,6 +553,7 @@ static void usb_setup(void)
                                         table[index(i, RX, ODD)].desc = 0;
 #ifdef USB_POOL
                                         ++usb_rx_memory_needed[i-1];
+                                        usb_mem_starved(i-1);
                                         // UsbLog("Request %d\r\n", i-1);
 #else
                                         ++usb_rx_memory_needed;
@@ -602,6 +806,45 @@ static void usb_setup(void)
                 datalen = 2;
                 data = reply_buffer;
                 break;
+            case 0xA040:
+                // Set TCK frequency (kHz) in wValue
+                blaster_clock (setup.wValue);
+                datalen = 0;
+                data = reply_buffer;
+                break;
+#ifdef USB_POOL
+            case 0xA1C0:
+                // Buffer pool telemetry. Clear the counters if wValue is 1
+                usb_mem_stats (pool_reply, setup.wValue == 1);
+                datalen = sizeof (pool_reply);
+                data = (const uint8_t *) pool_reply;
+                break;
+            case 0x0040:
+                // FTDI reset (wValue 0) or purge (1, 2). All drop both directions
+                usb_purge();
+                datalen = 0;
+                data = reply_buffer;
+                break;
+#endif
+            case 0x0940:
+                // FTDI set latency timer (ms) in the low byte of wValue
+                usb_latency_timer = (setup.wValue & 0xFF) ? setup.wValue : 1;
+                datalen = 0;
+                data = reply_buffer;
+                break;
+            case 0x0AC0:
+                // FTDI get latency timer
+                reply_buffer[0] = usb_latency_timer;
+                datalen = 1;
+                data = reply_buffer;
+                break;
+#ifdef USB_WATCHDOG_MS
+            case 0xA2C0:
+                // State recorded when the watchdog last fired
+                datalen = sizeof (usb_watchdog_state);
+                data = (const uint8_t *) &usb_watchdog_state;
+                break;
+#endif
 #endif
           default:
 #if defined(USB_BLASTER)
@@ -835,11 +1078,24 @@ static void usb_control(uint32_t stat)
 
 
 
+#ifdef USB_POOL
+// Take a received packet, but not one that arrived after a purge which
+// usb_rx_discard() has not yet dealt with. endpoint is zero based.
+static inline usb_packet_t *usb_rx_get(uint32_t endpoint)
+{
+        if (rx_purge[endpoint] && (rx_queue[endpoint].tail == rx_purge_mark[endpoint])) return NULL;
+        return usb_queue_get(&rx_queue[endpoint]);
+}
+#endif
+
 usb_packet_t *usb_rx(uint32_t endpoint)
 {
         usb_packet_t *ret;
         endpoint--;
         if (endpoint >= NUM_ENDPOINTS) return NULL;
+#ifdef USB_POOL
+        ret = usb_rx_get(endpoint);
+#else
         __disable_irq();
         ret = rx_first[endpoint];
         if (ret) {
@@ -847,6 +1103,7 @@ usb_packet_t *usb_rx(uint32_t endpoint)
                 usb_rx_byte_count_data[endpoint] -= ret->len;
         }
         __enable_irq();
+#endif
         //serial_print("rx, epidx=");
         //serial_phex(endpoint);
         //serial_print(", packet=");
@@ -855,6 +1112,67 @@ usb_packet_t *usb_rx(uint32_t endpoint)
         return ret;
 }
 
+#ifdef USB_POOL
+// Take up to nMax received packets at once. Returns the number taken.
+uint32_t usb_rx_batch(uint32_t endpoint, usb_packet_t **packets, uint32_t nMax)
+{
+        uint32_t n = 0;
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        while ((n < nMax) && ((packets[n] = usb_rx_get(endpoint)) != NULL)) n++;
+        return n;
+}
+
+// Free the received packets waiting on an endpoint. After a purge only those
+// that arrived before it are freed.
+void usb_rx_discard(uint32_t endpoint)
+{
+        usb_packet_t *p;
+        uint16_t mark;
+        uint32_t irq;
+        int purge;
+
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return;
+        irq = usb_irq_mask();
+        purge = rx_purge[endpoint];
+        mark = rx_purge_mark[endpoint];
+        rx_purge[endpoint] = 0;
+        usb_irq_restore(irq);
+        while (!purge || ((int16_t)(mark - rx_queue[endpoint].tail) > 0)) {
+                p = usb_queue_get(&rx_queue[endpoint]);
+                if (p == NULL) break;
+#if MEM_DEBUG > 0
+                usb_free(p, __LINE__);
+#else
+                usb_free(p);
+#endif
+        }
+}
+#endif
+
+#ifdef USB_POOL
+uint32_t usb_rx_byte_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return (uint16_t)(rx_queue[endpoint].bytes_in - rx_queue[endpoint].bytes_out);
+}
+
+uint32_t usb_tx_byte_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return (uint16_t)(tx_queue[endpoint].bytes_in - tx_queue[endpoint].bytes_out);
+}
+
+uint32_t usb_tx_packet_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return (uint16_t)(tx_queue[endpoint].head - tx_queue[endpoint].tail);
+}
+#else
 static uint32_t usb_queue_byte_count(const usb_packet_t *p)
 {
         uint32_t count=0;
@@ -900,6 +1218,7 @@ uint32_t usb_tx_packet_count(uint32_t endpoint)
         __enable_irq();
         return count;
 }
+#endif
 
 
 // Called from usb_free, but only when usb_rx_memory_needed > 0, indicating
@@ -914,12 +1233,13 @@ void usb_rx_memory(usb_packet_t *packet)
 {
         unsigned int i;
         const uint8_t *cfg;
+        uint32_t irq;
 
         cfg = usb_endpoint_config_table;
         //serial_print("rx_mem:");
-        __disable_irq();
+        irq = usb_irq_mask();
 #ifdef USB_POOL
-        i = packet->iPool + 1;
+        i = (packet->iPool & ~USB_POOL_BORROWED) + 1;
         cfg += i - 1;
                 {
 #else
@@ -937,7 +1257,7 @@ void usb_rx_memory(usb_packet_t *packet)
 #else
                                 --usb_rx_memory_needed;
 #endif
-                                __enable_irq();
+                                usb_irq_restore(irq);
                                 //serial_phex(i);
                                 //serial_print(",even\n");
                                 return;
@@ -950,14 +1270,14 @@ void usb_rx_memory(usb_packet_t *packet)
 #else
                                 --usb_rx_memory_needed;
 #endif
-                                __enable_irq();
+                                usb_irq_restore(irq);
                                 //serial_phex(i);
                                 //serial_print(",odd\n");
                                 return;
                         }
                 }
         }
-        __enable_irq();
+        usb_irq_restore(irq);
         // we should never reach this point.  If we get here, it means
         // usb_rx_memory_needed was set greater than zero, but no memory
         // was actually needed.
@@ -977,6 +1297,101 @@ void usb_rx_memory(usb_packet_t *packet)
 //#define index(endpoint, tx, odd) (((endpoint) << 2) | ((tx) << 1) | (odd))
 //#define stat2bufferdescriptor(stat) (table + ((stat) >> 2))
 
+#ifdef USB_POOL
+// Start packets waiting in the transmit queue on any free buffer descriptors.
+// endpoint is zero based.
+static void usb_tx_start(uint32_t endpoint)
+{
+        bdt_t *b;
+        usb_packet_t *packet;
+        uint8_t next;
+        uint32_t irq;
+
+        irq = usb_irq_mask();
+        for (;;) {
+                b = &table[index(endpoint + 1, TX, EVEN)];
+                switch (tx_state[endpoint]) {
+                  case TX_STATE_BOTH_FREE_EVEN_FIRST:
+                        next = TX_STATE_ODD_FREE;
+                        break;
+                  case TX_STATE_BOTH_FREE_ODD_FIRST:
+                        b++;
+                        next = TX_STATE_EVEN_FREE;
+                        break;
+                  case TX_STATE_EVEN_FREE:
+                        next = TX_STATE_NONE_FREE_ODD_FIRST;
+                        break;
+                  case TX_STATE_ODD_FREE:
+                        b++;
+                        next = TX_STATE_NONE_FREE_EVEN_FIRST;
+                        break;
+                  default:
+                        usb_irq_restore(irq);
+                        return;
+                }
+                // usb_isr() may already have sent it
+                packet = usb_queue_get(&tx_queue[endpoint]);
+                if (packet == NULL) break;
+                tx_state[endpoint] = next;
+                b->addr = packet->buf;
+                b->desc = BDT_DESC(packet->len, ((uint32_t)b & 8) ? DATA1 : DATA0);
+        }
+        usb_irq_restore(irq);
+}
+
+// Queue the packet. If a buffer descriptor is free, usb_isr() will not take it from
+// the queue, so start it here.
+void usb_tx(uint32_t endpoint, usb_packet_t *packet)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return;
+        usb_queue_put(&tx_queue[endpoint], packet);
+        if (*(volatile uint8_t *)&tx_state[endpoint] >= TX_STATE_NONE_FREE_EVEN_FIRST) return;
+        usb_tx_start(endpoint);
+}
+
+// Queue n packets, starting as many as there are free buffer descriptors with
+// usb_isr() masked only once
+void usb_tx_batch(uint32_t endpoint, usb_packet_t **packets, uint32_t n)
+{
+        uint32_t i;
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return;
+        for (i = 0; i < n; i++) usb_queue_put(&tx_queue[endpoint], packets[i]);
+        if (*(volatile uint8_t *)&tx_state[endpoint] >= TX_STATE_NONE_FREE_EVEN_FIRST) return;
+        usb_tx_start(endpoint);
+}
+
+// Send a packet the caller keeps, such as a status packet, but only if nothing
+// else is queued or being sent. It is never freed, and must not be changed while
+// it may still be waiting to be sent. Returns 1 if it was started.
+int usb_tx_status(uint32_t endpoint, usb_packet_t *packet)
+{
+        bdt_t *b;
+        int ret = 0;
+        uint32_t irq;
+
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        irq = usb_irq_mask();
+        if ((tx_queue[endpoint].head == tx_queue[endpoint].tail)
+          && (tx_state[endpoint] <= TX_STATE_BOTH_FREE_ODD_FIRST)) {
+                b = &table[index(endpoint + 1, TX, EVEN)];
+                if (tx_state[endpoint] == TX_STATE_BOTH_FREE_ODD_FIRST) {
+                        b++;
+                        tx_state[endpoint] = TX_STATE_EVEN_FREE;
+                } else {
+                        tx_state[endpoint] = TX_STATE_ODD_FREE;
+                }
+                tx_status[endpoint] = packet;
+                b->addr = packet->buf;
+                b->desc = BDT_DESC(packet->len, ((uint32_t)b & 8) ? DATA1 : DATA0);
+                ret = 1;
+        }
+        usb_irq_restore(irq);
+        return ret;
+}
+#else
 void usb_tx(uint32_t endpoint, usb_packet_t *packet)
 {
         bdt_t *b = &table[index(endpoint, TX, EVEN)];
@@ -1020,6 +1435,7 @@ void usb_tx(uint32_t endpoint, usb_packet_t *packet)
         b->desc = BDT_DESC(packet->len, ((uint32_t)b & 8) ? DATA1 : DATA0);
         __enable_irq();
 }
+#endif
 
 void usb_tx_isochronous(uint32_t endpoint, void *data, uint32_t len)
 {
@@ -1054,6 +1470,47 @@ void _reboot_Teensyduino_(void)
 
 
 
+#ifdef USB_WATCHDOG_MS
+// Called at the start of each frame. If an endpoint has been short of buffers, or had
+// packets queued behind its transmit buffer descriptors, with no transfers for
+// USB_WATCHDOG_MS, the host has stopped reading or sending. Record the state, free the
+// packets it will never read and have the sketch start again.
+static void usb_watchdog(void)
+{
+        static uint32_t tokens = 0;
+        static uint32_t frames = 0;
+        int i, bShort = 0;
+
+        for (i = 0; i < NUM_ENDPOINTS; i++) {
+                if (usb_rx_memory_needed[i] || (usb_mem_free(i + 1) == 0)) bShort = 1;
+                if (tx_queue[i].head != tx_queue[i].tail) bShort = 1;
+        }
+        if (!bShort || (usb_tokens != tokens)) {
+                tokens = usb_tokens;
+                frames = 0;
+                return;
+        }
+        if (++frames < USB_WATCHDOG_MS) return;
+        frames = 0;
+
+        ++usb_watchdog_state.trips;
+        usb_watchdog_state.millis = systick_millis_count;
+        usb_mem_stats(usb_watchdog_state.pool, 0);
+        for (i = 0; i < (NUM_ENDPOINTS + 1) * 4; i++) usb_watchdog_state.bdt[i] = table[i].desc;
+        for (i = 0; i < NUM_ENDPOINTS; i++) {
+                usb_watchdog_state.rx_memory_needed[i] = usb_rx_memory_needed[i];
+                usb_watchdog_state.tx_state[i] = tx_state[i];
+                usb_watchdog_state.rx_packets[i] = rx_queue[i].head - rx_queue[i].tail;
+                usb_watchdog_state.tx_packets[i] = tx_queue[i].head - tx_queue[i].tail;
+        }
+
+        // Receive descriptors left empty are refilled by usb_mem_frame() as soon as
+        // packets are freed, here or by the sketch dropping what it has received.
+        for (i = 0; i < NUM_ENDPOINTS; i++) usb_tx_reclaim(i);
+        blaster_watchdog();
+}
+#endif
+
 void usb_isr(void)
 {
         uint8_t status, stat, t;
@@ -1111,6 +1568,12 @@ void usb_isr(void)
 #endif
 #ifdef USB_BLASTER
                         blaster_flush ();
+#endif
+#ifdef USB_WATCHDOG_MS
+                        usb_watchdog ();
+#endif
+#ifdef USB_POOL
+                        usb_mem_frame ();
 #endif
                 }
                 USB0_ISTAT = USB_ISTAT_SOFTOK;  // Clear interrupt by writing back flag
@@ -1145,6 +1608,9 @@ void usb_isr(void)
                         serial_print("\n");
 #endif
                         endpoint--;     // endpoint is index to zero-based arrays
+#ifdef USB_WATCHDOG_MS
+                        ++usb_tokens;
+#endif
 
 #ifdef AUDIO_INTERFACE
                         if ((endpoint == AUDIO_TX_ENDPOINT-1) && (stat & 0x08)) {
@@ -1168,15 +1634,23 @@ void usb_isr(void)
                         } else
 #endif
                         if (stat & 0x08) { // transmit
+#ifdef USB_POOL
+                                if (packet != tx_status[endpoint])
+#endif
 #if MEM_DEBUG > 0
                                 usb_free(packet, __LINE__);   // Free the just transmitted packet
 #else
                                 usb_free(packet);   // Free the just transmitted packet
 #endif
+#ifdef USB_POOL
+                                packet = usb_queue_get(&tx_queue[endpoint]);    // Get the next queued packet
+                                if (packet) {   // If another packet
+#else
                                 packet = tx_first[endpoint];    // Get the next queued packet
                                 if (packet) {   // If another packet
                                         //serial_print("tx packet\n");
                                         tx_first[endpoint] = packet->next;  // Remove it from the queue
+#endif
                                         b->addr = packet->buf;  // And link it to the buffer descriptor
                                         // Update which BDs are in use
                                         switch (tx_state[endpoint]) {
@@ -1192,6 +1666,16 @@ void usb_isr(void)
                                           case TX_STATE_ODD_FREE:
                                                 tx_state[endpoint] = TX_STATE_NONE_FREE_EVEN_FIRST;
                                                 break;
+#ifdef USB_POOL
+                                          // The other BD is now the one to complete first,
+                                          // which usb_tx_reclaim() relies on
+                                          case TX_STATE_NONE_FREE_EVEN_FIRST:
+                                                tx_state[endpoint] = TX_STATE_NONE_FREE_ODD_FIRST;
+                                                break;
+                                          case TX_STATE_NONE_FREE_ODD_FIRST:
+                                                tx_state[endpoint] = TX_STATE_NONE_FREE_EVEN_FIRST;
+                                                break;
+#endif
                                           default:
                                                 break;
                                         }
@@ -1224,6 +1708,9 @@ void usb_isr(void)
                                 packet->len = b->desc >> 16;    // Get received length from BD
                                 if (packet->len > 0) {  // Data received - Add packet to received queue
                                         packet->index = 0;
+#ifdef USB_POOL
+                                        usb_queue_put(&rx_queue[endpoint], packet);
+#else
                                         packet->next = NULL;
                                         if (rx_first[endpoint] == NULL) {
                                                 //serial_print("rx 1st, epidx=");
@@ -1242,10 +1729,18 @@ void usb_isr(void)
                                         }
                                         rx_last[endpoint] = packet;
                                         usb_rx_byte_count_data[endpoint] += packet->len;
+#endif
+#ifdef USB_BLASTER
+                                        if (endpoint + 1 == BLASTER_RX_EP) blaster_rx_ready ();
+#endif
                                         // TODO: implement a per-endpoint maximum # of allocated
                                         // packets, so a flood of incoming data on 1 endpoint
                                         // doesn't starve the others if the user isn't reading
                                         // it regularly
+#ifdef USB_RX_HOLD
+                                        if (usb_rx_held(endpoint)) packet = NULL;
+                                        else
+#endif
 #ifdef USB_POOL
 #if MEM_DEBUG > 0
                                         packet = usb_malloc(endpoint + 1, __LINE__);
@@ -1266,6 +1761,10 @@ void usb_isr(void)
                                                 b->desc = 0;    // OWN flag not set. NAK / Stall if used?
 #ifdef USB_POOL
                                                 ++usb_rx_memory_needed[endpoint];
+#ifdef USB_RX_HOLD
+                                                if (!usb_rx_held(endpoint))
+#endif
+                                                usb_mem_starved(endpoint);
                                                 // UsbLog("Request %d\r\n", endpoint);
 #else
                                                 ++usb_rx_memory_needed;
@@ -1410,7 +1909,7 @@ void usb_init(void)
         USB0_INTEN = USB_INTEN_USBRSTEN;
 
         // enable interrupt in NVIC...
-        NVIC_SET_PRIORITY(IRQ_USBOTG, 112);
+        NVIC_SET_PRIORITY(IRQ_USBOTG, USB_IRQ_PRIORITY);
         NVIC_ENABLE_IRQ(IRQ_USBOTG);
 
         // enable d+ pullup
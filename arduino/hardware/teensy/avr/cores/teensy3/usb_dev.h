@@ -42,6 +42,7 @@
 // code which provides higher-level interfaces to the user.
 
 #include "usb_mem.h"
+#include "kinetis.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,6 +59,62 @@ void usb_tx_isochronous(uint32_t endpoint, void *data, uint32_t len);
 
 extern volatile uint8_t usb_configuration;
 
+// Critical sections shared with usb_isr(). On the Cortex-M4 these raise BASEPRI to
+// the USB interrupt's priority instead of masking every interrupt, so SysTick and
+// anything more urgent, such as a TCK timer or DMA completion, still runs. Such a
+// handler must not call the USB routines. The sections may be nested.
+#define USB_IRQ_PRIORITY        112
+#define USB_IRQ_TIMING          0       // 1 = record the longest section in usb_irq_masked_max
+#if defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_7M__)
+#if USB_IRQ_TIMING > 0
+extern uint32_t usb_irq_masked_at;
+extern volatile uint32_t usb_irq_masked_max;    // CPU cycles
+#endif
+static inline uint32_t usb_irq_mask(void) __attribute__((always_inline));
+static inline uint32_t usb_irq_mask(void)
+{
+        uint32_t saved;
+        __asm__ volatile("mrs %0, basepri" : "=r" (saved) :: "memory");
+        __asm__ volatile("msr basepri_max, %0" :: "r" (USB_IRQ_PRIORITY) : "memory");
+#if USB_IRQ_TIMING > 0
+        if (saved == 0) usb_irq_masked_at = ARM_DWT_CYCCNT;
+#endif
+        return saved;
+}
+
+static inline void usb_irq_restore(uint32_t saved) __attribute__((always_inline));
+static inline void usb_irq_restore(uint32_t saved)
+{
+#if USB_IRQ_TIMING > 0
+        if (saved == 0) {
+                uint32_t cycles = ARM_DWT_CYCCNT - usb_irq_masked_at;
+                if (cycles > usb_irq_masked_max) usb_irq_masked_max = cycles;
+        }
+#endif
+        __asm__ volatile("msr basepri, %0" :: "r" (saved) : "memory");
+}
+#else
+// No BASEPRI on the Cortex-M0+, so mask everything as before. Not nestable.
+static inline uint32_t usb_irq_mask(void)
+{
+        __disable_irq();
+        return 0;
+}
+
+static inline void usb_irq_restore(uint32_t saved)
+{
+        (void)saved;
+        __enable_irq();
+}
+#endif
+
+#ifdef USB_POOL
+uint32_t usb_rx_byte_count(uint32_t endpoint);
+uint32_t usb_rx_batch(uint32_t endpoint, usb_packet_t **packets, uint32_t nMax);
+void usb_tx_batch(uint32_t endpoint, usb_packet_t **packets, uint32_t n);
+void usb_rx_discard(uint32_t endpoint);
+int usb_tx_status(uint32_t endpoint, usb_packet_t *packet);
+#else
 extern uint16_t usb_rx_byte_count_data[NUM_ENDPOINTS];
 static inline uint32_t usb_rx_byte_count(uint32_t endpoint) __attribute__((always_inline));
 static inline uint32_t usb_rx_byte_count(uint32_t endpoint)
@@ -66,6 +123,7 @@ static inline uint32_t usb_rx_byte_count(uint32_t endpoint)
         if (endpoint >= NUM_ENDPOINTS) return 0;
         return usb_rx_byte_count_data[endpoint];
 }
+#endif
 
 #ifdef SEREMU_INTERFACE
 extern volatile uint8_t usb_seremu_transmit_flush_timer;
@@ -128,6 +186,25 @@ extern "C" {
 #endif
 extern uint8_t blaster_eeprom (uint16_t index);
 extern void blaster_flush (void);
+extern void blaster_clock (uint16_t freq);
+extern void blaster_rx_ready (void);
+extern void blaster_purge (void);
+extern volatile uint8_t usb_latency_timer;      // FTDI latency timer (ms) set by the host
+#ifdef USB_WATCHDOG_MS
+extern void blaster_watchdog (void);
+
+// State recorded when the watchdog last fired
+typedef struct {
+	uint32_t trips;                         // Times the watchdog has fired
+	uint32_t millis;                        // When it last fired
+	usb_pool_stats_t pool[NUM_ENDPOINTS + 1];
+	uint32_t bdt[(NUM_ENDPOINTS + 1) * 4];  // Buffer descriptor control words
+	uint8_t rx_memory_needed[NUM_ENDPOINTS];
+	uint8_t tx_state[NUM_ENDPOINTS];
+	uint16_t rx_packets[NUM_ENDPOINTS];     // Packets waiting in the queues
+	uint16_t tx_packets[NUM_ENDPOINTS];
+} usb_watchdog_snapshot_t;
+#endif
 #ifdef __cplusplus
 }
 #endif
@@ -76,12 +76,182 @@ const usb_packet_t * usb_mem_base(void)
 #endif  // MEM_DEBUG > 0
 
 #ifdef USB_POOL
+// Each endpoint has its own reserved pool, so that a flood of data on one endpoint
+// can never take the last buffer of another. The remaining USB_POOL_SHARED buffers are
+// in one more pool, borrowed by whichever endpoint has used up its reservation.
+// As for the single pool below, a set bit in usb_buffer_available marks a free buffer,
+// but there is one 32 bit word for every 32 buffers: buffer n is bit (31 - n % 32) of
+// word n / 32. Each pool owns the fixed set of bits in pool_mask[].
+#define POOL_SHARED     NUM_ENDPOINTS
+#define MAP_WORDS       ((NUM_USB_BUFFERS + 31) / 32)
+#define MAP_BIT(n)      (0x80000000 >> ((n) & 31))
 static int pool_size[] = USB_POOL;
-static usb_packet_t *pool_ptr[NUM_ENDPOINTS];
+static uint32_t pool_mask[NUM_ENDPOINTS + 1][MAP_WORDS];
+static volatile uint32_t usb_buffer_available[MAP_WORDS];
+
+// Buffers allocated from each pool, counted as they are taken and given back so
+// that neither the high water mark nor usb_mem_free() has to count the map
+static volatile uint32_t pool_used[NUM_ENDPOINTS + 1];
+
+static inline int pool_total(int iPool)
+    {
+    return ( iPool == POOL_SHARED ) ? USB_POOL_SHARED : pool_size[iPool];
+    }
+
+static inline unsigned int pool_free(int iPool)
+    {
+    return pool_total(iPool) - pool_used[iPool];
+    }
+
+// Always collected, so pool pressure can be seen without the timing changes of MEM_DEBUG
+static usb_pool_stats_t pool_stats[NUM_ENDPOINTS + 1];
+
+#if MEM_DEBUG > 0
+// Record an allocation event. The pools are not locked, so the log is.
+static void usb_mem_event(char type, usb_packet_t *ppkt, int iPool, int iLine)
+    {
+    uint32_t irq = usb_irq_mask();
+    if ( nEvt < NEVT )
+        {
+        usb_evt[nEvt].type = type;
+        usb_evt[nEvt].p = ppkt;
+        usb_evt[nEvt].iPool = iPool;
+        usb_evt[nEvt].iLine = iLine;
+        ++nEvt;
+        }
+    usb_irq_restore(irq);
+    }
+#endif
+
+#if defined(KINETISK)
+// The pools are shared between usb_isr() and the main program. Instead of masking
+// interrupts the map and counters are updated with LDREX / STREX. Exception return
+// clears the exclusive monitor, so if an update is interrupted its STREX fails and it
+// is retried with the new value.
+static inline uint32_t mem_ldrex(volatile uint32_t *pWord)
+    {
+    uint32_t uValue;
+    __asm__ volatile ("ldrex %0, [%1]" : "=r" (uValue) : "r" (pWord) : "memory");
+    return uValue;
+    }
+
+static inline int mem_strex(volatile uint32_t *pWord, uint32_t uValue)
+    {
+    int iFail;
+    __asm__ volatile ("strex %0, %2, [%1]" : "=&r" (iFail) : "r" (pWord), "r" (uValue) : "memory");
+    return iFail;
+    }
+
+static void stat_add(volatile uint32_t *pCount, int iAdd)
+    {
+    do  {}
+    while (mem_strex(pCount, mem_ldrex(pCount) + iAdd));
+    }
+
+static void stat_max(volatile uint32_t *pHigh, uint32_t uValue)
+    {
+    do  {
+        if ( mem_ldrex(pHigh) >= uValue )
+            {
+            __asm__ volatile ("clrex" ::: "memory");
+            return;
+            }
+        }
+    while (mem_strex(pHigh, uValue));
+    }
+
+// Take the first free buffer of pool iPool alone, or return NUM_USB_BUFFERS if none
+static unsigned int map_take(int iPool)
+    {
+    for (int w = 0; w < MAP_WORDS; ++w)
+        {
+        volatile uint32_t *pWord = &usb_buffer_available[w];
+        uint32_t avail, mask;
+        unsigned int n = 0;
+        do  {
+            avail = mem_ldrex(pWord);
+            mask = avail & pool_mask[iPool][w];
+            if ( mask == 0 )
+                {
+                __asm__ volatile ("clrex" ::: "memory");
+                break;
+                }
+            n = __builtin_clz(mask);
+            }
+        while (mem_strex(pWord, avail & ~(0x80000000 >> n)));
+        if ( mask != 0 )
+            {
+            stat_add(&pool_used[iPool], 1);
+            return 32 * w + n;
+            }
+        }
+    return NUM_USB_BUFFERS;
+    }
+
+static void pool_give(unsigned int n, int iPool)
+    {
+    volatile uint32_t *pWord = &usb_buffer_available[n / 32];
+    stat_add(&pool_used[iPool], -1);
+    do  {}
+    while (mem_strex(pWord, mem_ldrex(pWord) | MAP_BIT(n)));
+    }
+#else
+// No exclusive access instructions on Cortex-M0+
+static void stat_add(volatile uint32_t *pCount, int iAdd)
+    {
+    uint32_t irq = usb_irq_mask();
+    *pCount += iAdd;
+    usb_irq_restore(irq);
+    }
+
+static void stat_max(volatile uint32_t *pHigh, uint32_t uValue)
+    {
+    uint32_t irq = usb_irq_mask();
+    if ( *pHigh < uValue ) *pHigh = uValue;
+    usb_irq_restore(irq);
+    }
+
+static unsigned int map_take(int iPool)
+    {
+    unsigned int n = NUM_USB_BUFFERS;
+    uint32_t irq = usb_irq_mask();
+    for (int w = 0; w < MAP_WORDS; ++w)
+        {
+        uint32_t mask = usb_buffer_available[w] & pool_mask[iPool][w];
+        if ( mask != 0 )
+            {
+            n = 32 * w + __builtin_clz(mask);
+            usb_buffer_available[w] &= ~MAP_BIT(n);
+            ++pool_used[iPool];
+            break;
+            }
+        }
+    usb_irq_restore(irq);
+    return n;
+    }
+
+static void pool_give(unsigned int n, int iPool)
+    {
+    uint32_t irq = usb_irq_mask();
+    usb_buffer_available[n / 32] |= MAP_BIT(n);
+    --pool_used[iPool];
+    usb_irq_restore(irq);
+    }
+#endif
+
+// Take the first free buffer of pool iPool, or failing that of the shared region
+static unsigned int pool_take(int iPool)
+    {
+    unsigned int n = map_take(iPool);
+#if USB_POOL_SHARED > 0
+    if ( n == NUM_USB_BUFFERS ) n = map_take(POOL_SHARED);
+#endif
+    return n;
+    }
 
 int usb_mem_init(void)
     {
-    int nBuf = NUM_USB_BUFFERS;
+    unsigned int n = 0;
     usb_packet_t *ppkt = (usb_packet_t *) usb_buffer_memory;
     if (sizeof (pool_size) / sizeof (int) < NUM_ENDPOINTS)
         {
@@ -90,33 +260,41 @@ int usb_mem_init(void)
 #endif
         return 0;
         }
-    for (int iPool = 0; iPool < NUM_ENDPOINTS; ++iPool)
+    for (int w = 0; w < MAP_WORDS; ++w) usb_buffer_available[w] = 0;
+    for (int iPool = 0; iPool <= NUM_ENDPOINTS; ++iPool) pool_used[iPool] = 0;
+    for (int iPool = 0; iPool <= NUM_ENDPOINTS; ++iPool)
         {
-#if MEM_DEBUG > 1
-        UsbLog ("Buffer pool %d\r\n", iPool+1);
+        int nSize = pool_total(iPool);
+        for (int w = 0; w < MAP_WORDS; ++w) pool_mask[iPool][w] = 0;
+        if (( iPool < POOL_SHARED ) && ( nSize < 1 ))
+            {
+#if MEM_DEBUG > 0
+            UsbLog ("No buffers reserved for endpoint %d\r\n", iPool+1);
 #endif
-        pool_ptr[iPool] = NULL;
-        for (int i = 0; i < pool_size[iPool]; ++i)
+            return 0;
+            }
+        for (int i = 0; i < nSize; ++i)
             {
-            if (nBuf == 0)
+            if (n == NUM_USB_BUFFERS)
                 {
 #if MEM_DEBUG > 0
                 UsbLog ("Insufficient USB buffers.\r\n");
 #endif
                 return 0;
                 }
-            ppkt->next = pool_ptr[iPool];
-            ppkt->iPool = iPool;
-            pool_ptr[iPool] = ppkt;
-#if MEM_DEBUG > 1
-            UsbLog ("ppkt = %p, next = %p\r\n", ppkt, ppkt->next);
-#endif
+            ppkt->iPool = ( iPool == POOL_SHARED ) ? USB_POOL_BORROWED : iPool;
+            ppkt->iBuf = n;
+            pool_mask[iPool][n / 32] |= MAP_BIT(n);
             ++ppkt;
-            --nBuf;
+            ++n;
             }
+        for (int w = 0; w < MAP_WORDS; ++w)
+            {
 #if MEM_DEBUG > 1
-        UsbLog ("pool_ptr[%d] = %p\r\n", iPool, pool_ptr[iPool]);
+            UsbLog ("pool_mask[%d][%d] = 0x%08X\r\n", iPool, w, pool_mask[iPool][w]);
 #endif
+            usb_buffer_available[w] |= pool_mask[iPool][w];
+            }
         }
 #if MEM_DEBUG > 1
     UsbLog ("USB buffer pools created.\r\n");
@@ -124,23 +302,100 @@ int usb_mem_init(void)
     return 1;
     }
 
-#if MEM_DEBUG > 0
-void usb_mem_show(void)
+static usb_packet_t *pool_alloc(int iPool)
+    {
+    unsigned int n = pool_take(iPool);
+    if ( n >= NUM_USB_BUFFERS ) return NULL;
+    int iFrom = iPool;
+    usb_packet_t *ppkt = USB_PACKET(n);
+#if USB_POOL_SHARED > 0
+    if ( pool_mask[POOL_SHARED][n / 32] & MAP_BIT(n) )
+        {
+        ppkt->iPool = iPool | USB_POOL_BORROWED;
+        iFrom = POOL_SHARED;
+        }
+#endif
+    ppkt->len = 0;
+    ppkt->index = 0;
+    stat_max(&pool_stats[iFrom].high, pool_used[iFrom]);
+    return ppkt;
+    }
+
+// Buffers usb_malloc(iEP) could return now
+int usb_mem_free(int iEP)
+    {
+    return pool_free(iEP - 1) + pool_free(POOL_SHARED);
+    }
+
+// Called by usb_isr() when a receive endpoint is left without a buffer
+void usb_mem_starved(int iPool)
+    {
+    ++pool_stats[iPool].starve;
+    }
+
+// for the receive endpoints to request memory
+extern uint8_t usb_rx_memory_needed[NUM_ENDPOINTS];
+extern void usb_rx_memory(usb_packet_t *packet);
+#ifdef USB_RX_HOLD
+extern int usb_rx_held(unsigned int iEP);
+#endif
+
+// A receive endpoint is waiting for buffers, and is not being held off by usb_dev.c
+static inline int rx_wanted(int iPool)
+    {
+#ifdef USB_RX_HOLD
+    return usb_rx_memory_needed[iPool] && ! usb_rx_held(iPool);
+#else
+    return usb_rx_memory_needed[iPool];
+#endif
+    }
+
+// Called by usb_isr() at the start of each frame
+void usb_mem_frame(void)
     {
-    for (int i = 0; i < nEvt; ++i) UsbLog ("%c EP%d packet = %p (%d) line %d\r\n",
-        usb_evt[i].type, usb_evt[i].iPool+1, usb_evt[i].p,
-        usb_evt[i].p - (usb_packet_t *)usb_buffer_memory, usb_evt[i].iLine);
     for (int iPool = 0; iPool < NUM_ENDPOINTS; ++iPool)
         {
-        UsbLog("Pool %d:", iPool+1);
-        usb_packet_t *p =pool_ptr[iPool];
-        while (p != NULL)
+        // Refill any receive buffers left empty when the pool ran dry. usb_free() usually
+        // does this first, but misses a buffer freed while usb_isr() was finding the pool
+        // empty, which would otherwise leave the endpoint starved until the next free.
+        while ( rx_wanted(iPool) )
+            {
+            usb_packet_t *ppkt = pool_alloc(iPool);
+            if ( ppkt == NULL ) break;
+            usb_rx_memory(ppkt);
+            }
+        if ( rx_wanted(iPool) ) ++pool_stats[iPool].starve_frames;
+        }
+    }
+
+// Called by usb_isr() for the pool telemetry request, so only the counters updated
+// from the main program need care when they are cleared
+void usb_mem_stats(usb_pool_stats_t *pStats, int bClear)
+    {
+    for (int iPool = 0; iPool <= NUM_ENDPOINTS; ++iPool)
+        {
+        pStats[iPool] = pool_stats[iPool];
+        pStats[iPool].used = pool_used[iPool];
+        pStats[iPool].size = pool_total(iPool);
+        if ( bClear )
             {
-            UsbLog(" %d", p - (usb_packet_t *)usb_buffer_memory);
-            p = p->next;
+            // An interrupted stat_add() or stat_max() retries with the cleared value
+            pool_stats[iPool].high = pStats[iPool].used;
+            pool_stats[iPool].fail = 0;
+            pool_stats[iPool].starve = 0;
+            pool_stats[iPool].starve_frames = 0;
             }
-        UsbLog("\r\n");
         }
+    }
+
+#if MEM_DEBUG > 0
+void usb_mem_show(void)
+    {
+    for (int i = 0; i < nEvt; ++i) UsbLog ("%c EP%d packet = %p (%d) line %d\r\n",
+        usb_evt[i].type, usb_evt[i].iPool+1, usb_evt[i].p,
+        usb_evt[i].p - (usb_packet_t *)usb_buffer_memory, usb_evt[i].iLine);
+    for (int iPool = 0; iPool <= NUM_ENDPOINTS; ++iPool)
+        UsbLog("Pool %d: free %d\r\n", iPool+1, pool_free(iPool));
     usb_queues();
     nEvt = 0;
     }
@@ -153,72 +408,49 @@ usb_packet_t * usb_malloc(int iEP)
 #endif
     {
     int iPool = iEP - 1;
+    usb_packet_t *ppkt;
     if ((iEP <= 0) || (iEP > NUM_ENDPOINTS))
         {
 #if MEM_DEBUG > 0
-        if ( nEvt < NEVT )
-            {
-            usb_evt[nEvt].type = 'D';
-            usb_evt[nEvt].p = NULL;
-            usb_evt[nEvt].iPool = iPool;
-            usb_evt[nEvt].iLine = iLine;
-            ++nEvt;
-            }
+        usb_mem_event('D', NULL, iPool, iLine);
 #endif
         return NULL;
         }
-	__disable_irq();
-    usb_packet_t *ppkt = pool_ptr[iPool];
-    if ( ppkt != NULL )
-        {
-        pool_ptr[iPool] = ppkt->next;
-        ppkt->len = 0;
-        ppkt->index = 0;
-        ppkt->next = NULL;
-        }
+    ppkt = pool_alloc(iPool);
+    if ( ppkt == NULL ) stat_add(&pool_stats[iPool].fail, 1);
 #if MEM_DEBUG > 0
-    if ( nEvt < NEVT )
-        {
-        usb_evt[nEvt].type = 'A';
-        usb_evt[nEvt].p = ppkt;
-        usb_evt[nEvt].iPool = iPool;
-        usb_evt[nEvt].iLine = iLine;
-        ++nEvt;
-        }
+    usb_mem_event('A', ppkt, iPool, iLine);
 #endif
-	__enable_irq();
 #if MEM_DEBUG > 1
     if ((ppkt != NULL) || (bNull[iEP]))
         {
-        UsbLog ("usb_malloc (%d) = %p, pool_ptr[%d] = %p\r\n", iEP, ppkt, iPool, pool_ptr[iPool]);
+        UsbLog ("usb_malloc (%d) = %p, available = 0x%08X\r\n", iEP, ppkt, usb_buffer_available[0]);
         bNull[iEP] = ppkt != NULL;
         }
 #endif
     return ppkt;
     }
 
-// for the receive endpoints to request memory
-extern uint8_t usb_rx_memory_needed[NUM_ENDPOINTS];
-extern void usb_rx_memory(usb_packet_t *packet);
-
 #if MEM_DEBUG > 0
 void usb_free(usb_packet_t *ppkt, int iLine)
 #else
 void usb_free(usb_packet_t *ppkt)
 #endif
     {
-    int iPool = ppkt->iPool;
-    if ((iPool < 0) || (iPool >= NUM_ENDPOINTS))
+    // Each buffer holds its own index, so a bad address is found without a division
+    unsigned int n = ppkt->iBuf;
+    if ((n >= NUM_USB_BUFFERS) || (ppkt != USB_PACKET(n)))
         {
 #if MEM_DEBUG > 0
-        if ( nEvt < NEVT )
-            {
-            usb_evt[nEvt].type = 'C';
-            usb_evt[nEvt].p = ppkt;
-            usb_evt[nEvt].iPool = iPool;
-            usb_evt[nEvt].iLine = iLine;
-            ++nEvt;
-            }
+        usb_mem_event('B', ppkt, 0, iLine);
+#endif
+        return;
+        }
+    int iPool = ppkt->iPool & ~USB_POOL_BORROWED;
+    if (iPool >= NUM_ENDPOINTS)
+        {
+#if MEM_DEBUG > 0
+        usb_mem_event('C', ppkt, iPool, iLine);
 #endif
         return;
         }
@@ -226,43 +458,32 @@ void usb_free(usb_packet_t *ppkt)
 	// if the endpoint is starving for memory to receive
 	// packets, give this memory to them immediately!
     // Essential, as endpoint does not retry memory allocation if initially failed.
-	if (usb_rx_memory_needed[iPool] && usb_configuration) {
+	if (rx_wanted(iPool) && usb_configuration) {
         // UsbLog ("Assign packet\r\n");
 		usb_rx_memory(ppkt);
 		return;
 	}
-    
-	__disable_irq();
-	unsigned int n = ((uint8_t *)ppkt - usb_buffer_memory) / sizeof(usb_packet_t);
-	if (n >= NUM_USB_BUFFERS)
+#if USB_POOL_SHARED > 0
+    // A borrowed packet may go to any starving endpoint, not just the one that used it
+    if ((ppkt->iPool & USB_POOL_BORROWED) && usb_configuration)
         {
-#if MEM_DEBUG > 0
-        if ( nEvt < NEVT )
+        for (int i = 0; i < NUM_ENDPOINTS; ++i)
             {
-            usb_evt[nEvt].type = 'B';
-            usb_evt[nEvt].p = ppkt;
-            usb_evt[nEvt].iPool = 0;
-            usb_evt[nEvt].iLine = iLine;
-            ++nEvt;
+            if (rx_wanted(i))
+                {
+                ppkt->iPool = i | USB_POOL_BORROWED;
+                usb_rx_memory(ppkt);
+                return;
+                }
             }
-#endif
-        return;
         }
+#endif
 #if MEM_DEBUG > 0
-    if ( nEvt < NEVT )
-        {
-        usb_evt[nEvt].type = 'F';
-        usb_evt[nEvt].p = ppkt;
-        usb_evt[nEvt].iPool = ppkt->iPool;
-        usb_evt[nEvt].iLine = iLine;
-        ++nEvt;
-        }
+    usb_mem_event('F', ppkt, iPool, iLine);
 #endif
-    ppkt->next = pool_ptr[iPool];
-    pool_ptr[iPool] = ppkt;
-	__enable_irq();
+    pool_give(n, (ppkt->iPool & USB_POOL_BORROWED) ? POOL_SHARED : iPool);
 #if MEM_DEBUG > 1
-    UsbLog ("usb_free (%p), iPool = %d, next = %p\r\n", ppkt, iPool, ppkt->next);
+    UsbLog ("usb_free (%p), iPool = %d, available = 0x%08X\r\n", ppkt, iPool, usb_buffer_available[0]);
 #endif
     }
 #else   // USB_POOL not defined
@@ -42,22 +42,61 @@
 
 // It seems that buf must be 32 bit aligned. Therefore this structure
 // must be a multiple of 32 bits long.
+#ifdef USB_POOL
+// The queues in usb_dev.c hold buffer indices rather than linking the packets,
+// so the header is four bytes and packs down to 68 bytes a buffer.
+typedef struct usb_packet_struct {
+    uint8_t len;
+    uint8_t index;
+    uint8_t iPool;      // Endpoint - 1, or'ed with USB_POOL_BORROWED
+    uint8_t iBuf;       // Index in usb_buffer_memory
+	uint8_t buf[64];
+} usb_packet_t;
+#else
 typedef struct usb_packet_struct {
 	uint16_t len;
 	uint16_t index;
 	struct usb_packet_struct *next;
 	uint8_t buf[64];
+} usb_packet_t;
+#endif
+
 #ifdef USB_POOL
-    int iPool;
+#ifndef USB_POOL_SHARED
+#define USB_POOL_SHARED     0
+#endif
+#if NUM_USB_BUFFERS > 256
+#error "usb_packet_t.iBuf only indexes 256 USB buffers"
+#endif
+extern unsigned char usb_buffer_memory[];
+// The packet for a buffer index
+#define USB_PACKET(n)       ((usb_packet_t *) usb_buffer_memory + (n))
+// Flag in iPool for a packet borrowed from the shared region
+#define USB_POOL_BORROWED   0x80
 #endif
-} usb_packet_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #ifdef USB_POOL
+// Pool telemetry. One entry for each endpoint reservation, then one for the
+// shared region. The failure and starvation counts are per endpoint, so they
+// are always zero for the shared region.
+typedef struct {
+	uint32_t used;          // Buffers allocated now
+	uint32_t high;          // Most buffers allocated at once
+	uint32_t fail;          // usb_malloc() calls that found no buffer
+	uint32_t starve;        // Times the receive endpoint was left without a buffer
+	uint32_t starve_frames; // USB frames spent waiting for a receive buffer
+	uint32_t size;          // Buffers in the pool
+} usb_pool_stats_t;
+
 int usb_mem_init(void);
+int usb_mem_free(int iEP);
+void usb_mem_starved(int iPool);
+void usb_mem_frame(void);
+void usb_mem_stats(usb_pool_stats_t *pStats, int bClear);
 #if MEM_DEBUG > 0
 usb_packet_t * usb_malloc(int iEP, int iLine);
 void usb_free(usb_packet_t *p, int iLine);
@@ -31,6 +31,14 @@
 #include <Arduino.h>
 #include "EventResponder.h"
 
+#ifdef USB_BLASTER
+// The Blaster uses no serial events or EventResponder, and does its own idle
+// waiting in loop(), so there is nothing to do between calls to loop().
+void yield(void) __attribute__ ((weak));
+void yield(void)
+{
+}
+#else
 void yield(void) __attribute__ ((weak));
 void yield(void)
 {
@@ -62,3 +70,4 @@ void yield(void)
 	running = 0;
 	EventResponder::runFromYield();
 };
+#endif
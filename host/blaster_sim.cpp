@@ -0,0 +1,335 @@
+// Run a Blaster packet stream through the sketch and USB core
+//
+// Usage: blaster_sim [options] stream.txt
+//
+// Each line of the stream file is one OUT packet, as hex bytes, as made by
+// gen_streams.py. Each iteration the host sends up to --out-burst packets, the
+// sketch's loop() runs every --sketch-every iterations, the host polls for an IN
+// packet every --in-rate iterations, and there is a start of frame every third
+// iteration.
+//
+//   --in-rate N        Host IN poll interval, default 1
+//   --out-burst N      OUT packets offered per iteration, default 1
+//   --sketch-every N   Iterations per loop(), default 1
+//   --timed            While the sketch waits in yield(), keep the host to its rates
+//   --tck KHZ          Set the TCK frequency first (vendor request 0xA0)
+//   --latency MS       Set the FTDI latency timer first (vendor request 0x09)
+//   --hang N           After N packets, the host stops for 3000 frames, then
+//                      starts the stream again
+//   --purge N          After N packets, the host purges (FTDI request 0x00) and
+//                      starts the stream again at once
+//   --pool-stats       Show the buffer pool telemetry (vendor request 0xA1)
+//   --hist             Show the IN packet lengths
+//   --dump FILE        Write the data read back to FILE
+//
+// The result line gives the bytes read back and a hash of them, the number of
+// pin events and a hash of them, TCK rising edges, GPIO register accesses,
+// IN packets (and how many were empty), OUT NAKs, the interrupt mask balance,
+// the iteration at which the host finished sending, yield() calls, and the
+// iteration of the last IN packet with data. The second line gives the number
+// and host time of the sections that masked the USB interrupt, and of those
+// that would mask every interrupt, SysTick included, on the Teensy 3.5. The
+// third gives the commands and shifted bytes sent per second of host time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "sim.h"
+
+void sim_sketch_setup (void);
+void sim_sketch_loop (void);
+
+static std::vector<std::vector<uint8_t>> vPackets;
+static size_t iPacket = 0;
+static std::vector<uint8_t> vIn;
+static long iIter = 0;
+static long iDone = 0;
+static long iLastIn = 0;
+static long nStalls = 0;
+static long nYield = 0;
+static long nHangFrames = 0;
+static long nCommands = 0;
+static long nShifted = 0;
+static int nShiftLeft = 0;
+static int nInRate = 1;
+static int nOutBurst = 1;
+static int nSketchEvery = 1;
+static bool bTimed = false;
+
+static uint32_t fnv1a (const uint8_t *p, size_t n)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; ++i) h = ( h ^ p[i] ) * 16777619u;
+  return h;
+}
+
+// Count the commands in an OUT packet the device has taken. A byte with bit 7
+// set starts a shift of its low six bits' worth of bytes.
+static void count_packet (const std::vector<uint8_t> &v)
+{
+  for (uint8_t b : v)
+  {
+    if ( nShiftLeft > 0 )
+    {
+      --nShiftLeft;
+      ++nShifted;
+      continue;
+    }
+    ++nCommands;
+    if ( b & 0x80 ) nShiftLeft = b & 0x3F;
+  }
+}
+
+static void host_in (void)
+{
+  uint8_t uData[64];
+  int n = sim_usb_in (uData);
+  if ( n > 0 )
+  {
+    vIn.insert (vIn.end (), uData, uData + n);
+    iLastIn = iIter;
+  }
+}
+
+static void host_out (void)
+{
+  for (int k = 0; k < nOutBurst; ++k)
+  {
+    if (( iPacket < vPackets.size () ) && sim_usb_out (vPackets[iPacket].data (), vPackets[iPacket].size ()))
+    {
+      count_packet (vPackets[iPacket++]);
+    }
+  }
+}
+
+static void host_step (void)
+{
+  host_out ();
+  if ( iIter % nInRate == 0 ) host_in ();
+  if ( iIter % 3 == 0 ) sim_usb_sof ();
+  ++iIter;
+  if (( iPacket == vPackets.size () ) && ( iDone == 0 )) iDone = iIter;
+}
+
+// The sketch is waiting for a buffer. Without --timed the host catches up at once.
+void yield (void)
+{
+  if ( nHangFrames > 0 )
+  {
+    --nHangFrames;
+    sim_usb_sof ();
+    return;
+  }
+  if ( ++nYield % 100000 == 0 )
+  {
+    fprintf (stderr, "blaster_sim: stuck in yield()\n");
+    exit (1);
+  }
+  ++nStalls;
+  if ( bTimed )
+  {
+    host_step ();
+    return;
+  }
+  for (int i = 0; i < 4; ++i) host_in ();
+  sim_usb_sof ();
+}
+
+// A new session from the start of the stream, with the device back in its reset state
+static void restart (void)
+{
+  iPacket = 0;
+  nShiftLeft = 0;
+  vIn.clear ();
+  sim_device_reset ();
+}
+
+static bool read_stream (const char *psFile)
+{
+  FILE *f = fopen (psFile, "r");
+  if ( f == NULL ) return false;
+  char sLine[1024];
+  while ( fgets (sLine, sizeof (sLine), f) )
+  {
+    std::vector<uint8_t> v;
+    const char *s = sLine;
+    unsigned int u;
+    int n;
+    while ( sscanf (s, "%x%n", &u, &n) == 1 )
+    {
+      v.push_back (u);
+      s += n;
+    }
+    if ( ! v.empty () ) vPackets.push_back (v);
+  }
+  fclose (f);
+  return true;
+}
+
+static void usage (void)
+{
+  fprintf (stderr, "Usage: blaster_sim [--in-rate N] [--out-burst N] [--sketch-every N] [--timed]\n"
+    "  [--tck KHZ] [--latency MS] [--hang N] [--purge N] [--pool-stats] [--hist]\n"
+    "  [--dump FILE] stream.txt\n");
+  exit (2);
+}
+
+int main (int argc, char **argv)
+{
+  const char *psStream = NULL;
+  const char *psDump = NULL;
+  int nTck = -1;
+  int nLatency = -1;
+  long iHang = -1;
+  long iPurge = -1;
+  bool bPoolStats = false;
+  bool bHist = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string s = argv[i];
+    bool bArg = ( i + 1 < argc );
+    if (( s == "--in-rate" ) && bArg ) nInRate = atoi (argv[++i]);
+    else if (( s == "--out-burst" ) && bArg ) nOutBurst = atoi (argv[++i]);
+    else if (( s == "--sketch-every" ) && bArg ) nSketchEvery = atoi (argv[++i]);
+    else if ( s == "--timed" ) bTimed = true;
+    else if (( s == "--tck" ) && bArg ) nTck = atoi (argv[++i]);
+    else if (( s == "--latency" ) && bArg ) nLatency = atoi (argv[++i]);
+    else if (( s == "--hang" ) && bArg ) iHang = atol (argv[++i]);
+    else if (( s == "--purge" ) && bArg ) iPurge = atol (argv[++i]);
+    else if ( s == "--pool-stats" ) bPoolStats = true;
+    else if ( s == "--hist" ) bHist = true;
+    else if (( s == "--dump" ) && bArg ) psDump = argv[++i];
+    else if (( s[0] != '-' ) && ( psStream == NULL )) psStream = argv[i];
+    else usage ();
+  }
+  if (( psStream == NULL ) || ( nInRate < 1 ) || ( nSketchEvery < 1 )) usage ();
+  if ( ! read_stream (psStream) )
+  {
+    fprintf (stderr, "blaster_sim: cannot read %s\n", psStream);
+    return 2;
+  }
+
+  sim_sketch_setup ();
+  sim_usb_reset ();
+  if ( nTck >= 0 ) sim_usb_setup (0x40, 0xA0, nTck, 0, 0);
+  if ( nLatency >= 0 )
+  {
+    uint8_t uReply[64];
+    sim_usb_setup (0x40, 0x09, nLatency, 0, 0);
+    sim_usb_setup (0xC0, 0x0A, 0, 0, 1, uReply);
+    printf ("  latency timer: %u ms\n", uReply[0]);
+  }
+  long nOps0 = sim_gpio_ops;
+  auto tStart = std::chrono::steady_clock::now ();
+
+  while (( iPacket < vPackets.size () ) || ( iIter < 2000 ))
+  {
+    if (( iHang >= 0 ) && ( (long)iPacket >= iHang ))
+    {
+      // The host stops reading and sending, then starts a new session
+      iHang = -1;
+      nHangFrames = 3000;
+      while ( nHangFrames > 0 )
+      {
+        --nHangFrames;
+        sim_sketch_loop ();
+        sim_usb_sof ();
+      }
+      printf ("  hang: after %zu packets and %zu bytes, watchdog trips %u\n",
+        iPacket, vIn.size (), sim_usb_watchdog_trips ());
+      restart ();
+    }
+    if (( iPurge >= 0 ) && ( (long)iPacket >= iPurge ))
+    {
+      // The host purges and starts again at once, sending before the sketch runs.
+      // Like the FTDI driver, it drops whatever was already on its way to it.
+      iPurge = -1;
+      size_t nBefore = vIn.size ();
+      sim_usb_setup (0x40, 0x00, 0, 0, 0);
+      int nStale = 0;
+      while (( nStale < 2 ) && ( sim_usb_in (NULL) >= 0 )) ++nStale;
+      restart ();
+      for (int k = 0; k < 3; ++k)
+      {
+        if ( sim_usb_out (vPackets[iPacket].data (), vPackets[iPacket].size ()) ) count_packet (vPackets[iPacket++]);
+      }
+      printf ("  purge: after %zu bytes and %d packets in flight, then %zu packets sent before the sketch ran\n",
+        nBefore, nStale, iPacket);
+    }
+    host_out ();
+    if ( iIter % nSketchEvery == 0 ) sim_sketch_loop ();
+    sim_swi ();
+    if ( iIter % nInRate == 0 ) host_in ();
+    if ( iIter % 3 == 0 ) sim_usb_sof ();
+    ++iIter;
+    if (( iPacket == vPackets.size () ) && ( iDone == 0 )) iDone = iIter;
+    if ( iIter > 10000000 )
+    {
+      fprintf (stderr, "blaster_sim: stuck after %zu packets\n", iPacket);
+      return 1;
+    }
+  }
+  // Collect the last results
+  for (int i = 0; i < 50; ++i)
+  {
+    sim_sketch_loop ();
+    host_in ();
+    sim_usb_sof ();
+  }
+  double tRun = std::chrono::duration<double> (std::chrono::steady_clock::now () - tStart).count ();
+
+  if ( psDump != NULL )
+  {
+    FILE *f = fopen (psDump, "wb");
+    if ( f != NULL )
+    {
+      fwrite (vIn.data (), 1, vIn.size (), f);
+      fclose (f);
+    }
+  }
+  long nOps = sim_gpio_ops - nOps0;
+  SimIrqStats irq = sim_irq_stats ();
+  printf ("in_bytes=%zu in_hash=%08x ev=%zu ev_hash=%08x rising=%ld gpio_ops=%ld ops/bit=%.2f"
+    " in_pkts=%ld empty=%ld naks=%ld irq=%d iter=%ld stalls=%ld end=%ld\n",
+    vIn.size (), fnv1a (vIn.data (), vIn.size ()), sim_events.size (),
+    fnv1a ((const uint8_t *)sim_events.data (), sim_events.size ()), sim_rising, nOps,
+    sim_rising ? (double)nOps / sim_rising : 0.0, sim_usb_stats.nIn, sim_usb_stats.nEmpty,
+    sim_usb_stats.nNak, irq.nDepth, iDone, nStalls, iLastIn);
+  printf ("  masked: %ld sections, mean %.0f ns, longest %.0f ns; all interrupts %ld, longest %.0f ns\n",
+    irq.nSections, irq.nSections ? irq.tTotal / irq.nSections : 0.0, irq.tMax, irq.nAll, irq.tAllMax);
+  printf ("  rate: %ld commands and %ld shifted bytes in %.3f s, %.0f commands/s, %.0f bytes/s\n",
+    nCommands, nShifted, tRun, nCommands / tRun, nShifted / tRun);
+  if ( bHist )
+  {
+    printf ("  IN lengths:");
+    for (int k = 0; k <= 64; ++k)
+    {
+      if ( sim_usb_stats.nInHist[k] ) printf (" %d:%ld", k, sim_usb_stats.nInHist[k]);
+    }
+    printf ("\n");
+  }
+  if ( bPoolStats )
+  {
+    static const char *psPool[] = { "EP1 (TX)", "EP2 (RX)", "Shared" };
+    // Six 32 bit counts for each pool, as usb_pool_stats_t
+    uint8_t uReply[72];
+    int n = sim_usb_setup (0xC0, 0xA1, 0, 0, 72, uReply);
+    for (int k = 0; 24 * ( k + 1 ) <= n; ++k)
+    {
+      uint32_t u[6];
+      memcpy (u, uReply + 24 * k, sizeof (u));
+      printf ("  pool %-9s used %u of %u high %u fail %u starve %u frames %u\n", psPool[k % 3],
+        u[0], u[5], u[1], u[2], u[3], u[4]);
+    }
+  }
+  if ( nTck >= 0 )
+  {
+    double tMean, tFastest;
+    sim_tck_khz (&tMean, &tFastest);
+    printf ("  tck: mean %.1f kHz, fastest %.1f kHz\n", tMean, tFastest);
+  }
+  return 0;
+}
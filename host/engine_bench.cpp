@@ -0,0 +1,139 @@
+// Throughput of BlasterEngine alone, with mock pins and transport
+//
+// Usage: engine_bench [--repeat N] stream.txt
+//
+// Runs the packets of a stream through BlasterEngine::process() N times, or
+// without --repeat as many times as take at least a second, and reports
+// commands, shifted bytes and pin accesses per second of host time. The mock pins count port accesses the way
+// TeensyPins makes them: a write or a read is one access, a TCK pulse two
+// writes and a read if it reads. The mock byte shift is the GPIO one, three
+// writes and a read per bit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "BlasterEngine.h"
+
+static long nAccess = 0;            // Port register accesses
+static long nCommand = 0;
+static long nShifted = 0;
+static long nResult = 0;
+static uint8_t uSent = 0;           // Fold of the results, so the work is not optimised away
+
+struct MockPins
+{
+  static uint8_t uOut;
+  static inline void write (uint8_t uPins)
+  {
+    uOut = uPins;
+    ++nAccess;
+  }
+  static inline uint8_t read (void)
+  {
+    ++nAccess;
+    return ( uOut >> 4 ) & BIT_TDO;
+  }
+  static inline uint8_t pulse (uint8_t uPins, bool bRead)
+  {
+    uOut = uPins;
+    nAccess += bRead ? 3 : 2;
+    return bRead ? ( uOut >> 4 ) & BIT_TDO : 0;
+  }
+  static inline void led (bool) {}
+};
+uint8_t MockPins::uOut = 0;
+
+struct MockTransport
+{
+  static inline bool stop (void) { return false; }
+  static inline bool ready (void) { return true; }
+  static inline void send (uint8_t u)
+  {
+    uSent ^= u;
+    ++nResult;
+  }
+  static inline int shift (const uint8_t *pSend, int nByte, uint8_t uShift)
+  {
+    for (int i = 0; i < nByte; ++i)
+    {
+      uint8_t u = pSend[i];
+      uint8_t uRecv = 0;
+      for (int j = 0; j < 8; ++j)
+      {
+        uRecv = ( uRecv >> 1 ) | (( u & 1 ) << 7 );
+        u >>= 1;
+      }
+      nAccess += ( uShift == SHIFT_WRITE ) ? 24 : 32;
+      if ( uShift != SHIFT_WRITE ) send (uRecv);
+    }
+    nShifted += nByte;
+    return nByte;
+  }
+};
+
+struct CountTrace : BlasterNoTrace
+{
+  static inline void command (uint8_t) { ++nCommand; }
+};
+
+static BlasterEngine<MockPins, MockTransport, CountTrace> engine;
+
+int main (int argc, char **argv)
+{
+  const char *psStream = NULL;
+  int nRepeat = 0;                  // Until a second has passed
+  for (int i = 1; i < argc; ++i)
+  {
+    if (( strcmp (argv[i], "--repeat") == 0 ) && ( i + 1 < argc )) nRepeat = atoi (argv[++i]);
+    else if (( argv[i][0] != '-' ) && ( psStream == NULL )) psStream = argv[i];
+    else psStream = NULL, i = argc;
+  }
+  FILE *f = psStream ? fopen (psStream, "r") : NULL;
+  if (( f == NULL ) || ( nRepeat < 0 ))
+  {
+    fprintf (stderr, "Usage: engine_bench [--repeat N] stream.txt\n");
+    return 2;
+  }
+  std::vector<std::vector<uint8_t>> vPackets;
+  char sLine[1024];
+  while ( fgets (sLine, sizeof (sLine), f) )
+  {
+    std::vector<uint8_t> v;
+    const char *s = sLine;
+    unsigned int u;
+    int n;
+    while ( sscanf (s, "%x%n", &u, &n) == 1 )
+    {
+      v.push_back (u);
+      s += n;
+    }
+    if ( ! v.empty () ) vPackets.push_back (v);
+  }
+  fclose (f);
+
+  auto t0 = std::chrono::steady_clock::now ();
+  double t = 0.0;
+  int nDone = 0;
+  while ( nRepeat > 0 ? nDone < nRepeat : t < 1.0 )
+  {
+    engine.reset ();
+    for (auto &v : vPackets)
+    {
+      int n = engine.process (v.data (), 0, v.size ());
+      if ( n != (int)v.size () )
+      {
+        fprintf (stderr, "engine_bench: process() stopped at %d of %zu\n", n, v.size ());
+        return 1;
+      }
+    }
+    ++nDone;
+    t = std::chrono::duration<double> (std::chrono::steady_clock::now () - t0).count ();
+  }
+  printf ("%d x %zu packets in %.3f s: %.2f M commands/s, %.2f MB/s shifted, %.1f M port accesses/s,"
+    " %ld results (%02X)\n", nDone, vPackets.size (), t, nCommand / t / 1e6, nShifted / t / 1e6,
+    nAccess / t / 1e6, nResult, uSent);
+  return 0;
+}
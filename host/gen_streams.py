@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Make a Blaster OUT packet stream for blaster_sim.
+
+Usage: gen_streams.py KIND [SEED] > stream.txt
+
+KIND is one of
+  mix    TAP navigation with a shift of 1-150 bytes each time, half of them read
+  small  Mostly TAP navigation, with a shift 30% of the time
+  read   Read shifts of 100-600 bytes
+  write  Write shifts of 500-1500 bytes
+  as     Active serial: nCS low, a shift of 1-200 bytes (70% read), then nCS high
+
+The commands are split into packets of 64 bytes, with one in four of random
+length, and written one packet per line as hex bytes. The same seed always
+gives the same stream.
+"""
+
+import random
+import sys
+
+KINDS = ('mix', 'small', 'read', 'write', 'as')
+
+
+def bit_bang(tms, tdi, rd=False, ncs=1):
+    """One TCK clock: a bit bang byte with TCK low, then the same with TCK high."""
+    base = 0x20 | 0x04 | (0x08 if ncs else 0) | (0x02 if tms else 0) | (0x10 if tdi else 0) | (0x40 if rd else 0)
+    return [base, base | 1]
+
+
+def shift(data, rd):
+    """Shift commands of up to 63 bytes each."""
+    out = []
+    while data:
+        n = min(63, len(data))
+        out.append(0x80 | (0x40 if rd else 0) | n)
+        out += data[:n]
+        data = data[n:]
+    return out
+
+
+def tap_nav(s, bits, rd=False, ncs=1):
+    for tms in bits:
+        s.extend(bit_bang(tms, random.randint(0, 1), rd and random.random() < 0.5, ncs))
+
+
+def random_bytes(n):
+    return [random.randint(0, 255) for _ in range(n)]
+
+
+def commands(kind):
+    s = []
+    if kind in ('mix', 'small'):
+        for _ in range(40 if kind == 'mix' else 300):
+            tap_nav(s, [1, 1, 1, 1, 1, 0, 1, 0, 0])
+            if kind == 'mix' or random.random() < 0.3:
+                n = random.randint(1, 150)
+                s.extend(shift(random_bytes(n), random.random() < 0.5))
+            tap_nav(s, [1, 1, 0], rd=True)
+    elif kind == 'read':
+        for _ in range(30):
+            tap_nav(s, [0, 1, 0, 0])
+            s.extend(shift(random_bytes(random.randint(100, 600)), True))
+            tap_nav(s, [1, 1, 0])
+    elif kind == 'write':
+        for _ in range(30):
+            tap_nav(s, [0, 1, 0, 0])
+            s.extend(shift(random_bytes(random.randint(500, 1500)), False))
+            tap_nav(s, [1, 1, 0])
+    elif kind == 'as':
+        for _ in range(20):
+            s.extend([0x20 | 0x04, 0x20 | 0x04])
+            s.extend(shift(random_bytes(random.randint(1, 200)), random.random() < 0.7))
+            s.extend(bit_bang(0, 1, True, ncs=0))
+            s.extend([0x2C])
+    return s
+
+
+def main():
+    if len(sys.argv) < 2 or sys.argv[1] not in KINDS:
+        sys.exit(__doc__)
+    random.seed(int(sys.argv[2]) if len(sys.argv) > 2 else 1)
+    s = commands(sys.argv[1])
+    i = 0
+    while i < len(s):
+        n = random.choice([64, 64, 64, random.randint(1, 64)])
+        print(' '.join('%02X' % b for b in s[i:i + n]))
+        i += n
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,56 @@
+# Make the host build copy of a sketch or core source file
+#
+#   cmake -DIN=<file> -DOUT=<file> [-DDEFINES=NAME=VALUE,...] -P hostify.cmake
+#
+# Replaces the few lines that only build for ARM, points the pinmap.h register
+# macros at the simulated registers, keeps the buffer descriptor table entries
+# 8 bytes long, tells the interrupt model which masked sections would hold off
+# only the USB interrupt on the Teensy 3.5, and sets the sketch's option
+# defines (SPI_SHIFT and so on).
+
+file(READ "${IN}" s)
+
+string(REPLACE "__asm__ volatile(\"bkpt\");" "abort();" s "${s}")
+string(REPLACE "asm volatile (\"wfi\")" "(void)0" s "${s}")
+string(REPLACE "        void * addr;" "        HostPtr addr;" s "${s}")
+string(REPLACE "static bdt_t table[(NUM_ENDPOINTS+1)*4];"
+  "static bdt_t table[(NUM_ENDPOINTS+1)*4] __attribute__((aligned(512)));" s "${s}")
+string(REGEX REPLACE "#define GPIO_REG\\(port, offset\\) +[^\n]*"
+  "#define GPIO_REG(port, offset)  gpio_regs[port][(offset) / 4]" s "${s}")
+string(REGEX REPLACE "#define PORT_PCR\\(port, bit\\) +[^\n]*"
+  "#define PORT_PCR(port, bit)     sim_pcr[port][bit]" s "${s}")
+
+# The host has no BASEPRI or LDREX / STREX, so usb_irq_mask() falls back to
+# __disable_irq() and the pools take their Cortex-M0+ path. Mark both kinds of
+# section, in trees before and after usb_irq_mask(), so the model can tell them
+# from the ones that mask every interrupt on the Teensy 3.5.
+string(FIND "${s}" "// No exclusive access instructions on Cortex-M0+" m0)
+if(m0 GREATER -1)
+  string(SUBSTRING "${s}" 0 ${m0} head)
+  string(SUBSTRING "${s}" ${m0} -1 tail)
+  string(FIND "${tail}" "\n#endif" end)
+  string(SUBSTRING "${tail}" 0 ${end} pools)
+  string(SUBSTRING "${tail}" ${end} -1 tail)
+  string(REPLACE "__disable_irq()" "sim_pool_irq_mask()" pools "${pools}")
+  string(REPLACE "usb_irq_mask()" "sim_pool_irq_mask()" pools "${pools}")
+  set(s "${head}${pools}${tail}")
+endif()
+string(REPLACE "usb_irq_mask()" "sim_usb_irq_mask()" s "${s}")
+string(REPLACE "usb_irq_restore(" "sim_irq_restore(" s "${s}")
+
+if(DEFINES)
+  string(REPLACE "," ";" DEFINES "${DEFINES}")
+  foreach(d ${DEFINES})
+    if(NOT d MATCHES "^([A-Z_0-9]+)=(.+)$")
+      message(FATAL_ERROR "hostify: bad define ${d}")
+    endif()
+    set(name "${CMAKE_MATCH_1}")
+    set(value "${CMAKE_MATCH_2}")
+    if(NOT s MATCHES "#define ${name} +[^ \n]+")
+      message(FATAL_ERROR "hostify: ${IN} has no #define ${name}")
+    endif()
+    string(REGEX REPLACE "#define ${name}( +)[^ \n]+" "#define ${name}\\1${value}" s "${s}")
+  endforeach()
+endif()
+
+file(WRITE "${OUT}" "${s}")
@@ -0,0 +1,130 @@
+// Speed of the pooled usb_malloc() and usb_free()
+//
+// Usage: mem_bench [--pairs N]
+//
+// Runs N (default 2000000) allocations and frees in each of three patterns and
+// reports pairs per second of host time, with the number, mean host time and
+// longest host time of the sections that masked the USB interrupt:
+//
+//   pair     one buffer taken and given back, over and over
+//   burst    all the transmit endpoint can have, then all given back
+//   mixed    both endpoints, up to 12 held at once and freed oldest first,
+//            so some come from the shared region
+//
+// The device is not configured, so freed buffers always go back to the pools.
+// The host build has no LDREX / STREX, so the pools mask the interrupt as on
+// the Cortex-M0+; on the Teensy 3.5 the bitmap allocator masks nothing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "usb_dev.h"
+#include "usb_mem.h"
+#include "sim.h"
+
+// Core callbacks
+uint8_t blaster_eeprom (uint16_t) { return 0; }
+void blaster_flush (void) {}
+void blaster_clock (uint16_t) {}
+void blaster_rx_ready (void) {}
+void blaster_purge (void) {}
+void blaster_watchdog (void) {}
+
+// Not used, as there is no sketch
+void sim_pin_location (int, int *pPort, int *pBit) { *pPort = *pBit = 0; }
+int sim_signal_pin (int) { return 0; }
+void yield (void) {}
+
+static long nHeld = 0;              // Fold of the buffers taken, so none of it is optimised away
+
+static void pattern_pair (long nPairs)
+{
+  for (long i = 0; i < nPairs; ++i)
+  {
+    usb_packet_t *p = usb_malloc (BLASTER_TX_EP);
+    nHeld += ( p != NULL );
+    usb_free (p);
+  }
+}
+
+static void pattern_burst (long nPairs)
+{
+  usb_packet_t *p[NUM_USB_BUFFERS];
+  long nDone = 0;
+  while ( nDone < nPairs )
+  {
+    int n = 0;
+    while (( n < NUM_USB_BUFFERS ) && (( p[n] = usb_malloc (BLASTER_TX_EP) ) != NULL )) ++n;
+    nHeld += n;
+    for (int k = 0; k < n; ++k) usb_free (p[k]);
+    nDone += n;
+  }
+}
+
+static void pattern_mixed (long nPairs)
+{
+  usb_packet_t *p[12] = {};
+  int iOld = 0;
+  for (long i = 0; i < nPairs; ++i)
+  {
+    if ( p[iOld] != NULL ) usb_free (p[iOld]);
+    p[iOld] = usb_malloc (( i & 1 ) ? BLASTER_TX_EP : BLASTER_RX_EP);
+    nHeld += ( p[iOld] != NULL );
+    iOld = ( iOld + 1 ) % 12;
+  }
+  for (int k = 0; k < 12; ++k)
+  {
+    if ( p[k] != NULL ) usb_free (p[k]);
+  }
+}
+
+static void run (const char *psName, void (*pfn) (long), long nPairs)
+{
+  // The host's own interruptions swamp the longest section of a long run, so
+  // take the median of the longest in each block of 1000 pairs
+  std::vector<double> vMax;
+  SimIrqStats irq0 = sim_irq_stats ();
+  double t = 0;
+  for (long nDone = 0; nDone < nPairs; nDone += 1000)
+  {
+    sim_irq_reset_max ();
+    auto t0 = std::chrono::steady_clock::now ();
+    pfn (1000);
+    t += std::chrono::duration<double> (std::chrono::steady_clock::now () - t0).count ();
+    vMax.push_back (sim_irq_stats ().tMax);
+  }
+  std::sort (vMax.begin (), vMax.end ());
+  SimIrqStats irq = sim_irq_stats ();
+  long nRun = 1000 * (long)vMax.size ();
+  printf ("%-6s %6.2f M pairs/s  %.1f masked sections per pair, mean %.0f ns, longest %.0f ns\n",
+    psName, nRun / t / 1e6, (double)( irq.nSections - irq0.nSections ) / nRun,
+    ( irq.tTotal - irq0.tTotal ) / ( irq.nSections - irq0.nSections ), vMax[vMax.size () / 2]);
+}
+
+int main (int argc, char **argv)
+{
+  long nPairs = 2000000;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (( strcmp (argv[i], "--pairs") == 0 ) && ( i + 1 < argc )) nPairs = atol (argv[++i]);
+    else
+    {
+      fprintf (stderr, "Usage: mem_bench [--pairs N]\n");
+      return 2;
+    }
+  }
+
+  usb_init ();
+  run ("pair", pattern_pair, nPairs);
+  run ("burst", pattern_burst, nPairs);
+  run ("mixed", pattern_mixed, nPairs);
+  if ( nHeld < nPairs )
+  {
+    fprintf (stderr, "mem_bench: usb_malloc() failed\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Compare the fixed and shared USB buffer pools on mixed workloads.
+
+Usage: pool_bench.py [BUILD_DIR]
+
+Runs each packet stream through blaster_sim_static (the core with a fixed split
+of 4 transmit and 20 receive buffers) and blaster_sim_gpio (4 reserved for each
+endpoint and 16 shared), with the host and the sketch at several relative
+speeds, and prints for each the iteration at which the host finished sending,
+the iteration of the last IN packet with data, the OUT NAKs, and the failed
+transmit allocations. Both builds run the same sketch, so they must read back
+the same bytes; fewer iterations means the host was kept waiting less.
+"""
+
+import os
+import re
+import subprocess
+import sys
+
+STREAMS = ('mix', 'small', 'read', 'write', 'as')
+PROFILES = (
+    ('host fast', []),
+    ('host bursts', ['--out-burst', '4']),
+    ('slow reads', ['--out-burst', '4', '--in-rate', '8']),
+    ('sketch slow', ['--out-burst', '4', '--sketch-every', '4']),
+)
+BUILDS = ('static', 'gpio')
+
+
+def run(build_dir, build, stream, args):
+    """One blaster_sim run, as a dict of the figures wanted."""
+    sim = os.path.join(build_dir, 'blaster_sim_' + build)
+    out = subprocess.run([sim, '--pool-stats'] + args + [os.path.join(build_dir, stream + '.txt')],
+                         check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    result = dict(re.findall(r'(\w+)=(\w+)', out.splitlines()[0]))
+    tx = re.search(r'pool EP1 \(TX\) +used \d+ of \d+ high \d+ fail (\d+)', out)
+    return {'hash': result['in_hash'], 'iter': int(result['iter']), 'end': int(result['end']),
+            'naks': int(result['naks']), 'fail': int(tx.group(1))}
+
+
+def main():
+    build_dir = sys.argv[1] if len(sys.argv) > 1 else '.'
+    print('%-6s %-12s %23s %23s' % ('', '', 'fixed {4, 20}', 'shared {4, 4} + 16'))
+    print('%-6s %-12s' % ('stream', 'profile') + ' %6s %6s %5s %4s' % ('iter', 'end', 'naks', 'fail') * 2)
+    total = {b: 0 for b in BUILDS}
+    bad = 0
+    for stream in STREAMS:
+        for name, args in PROFILES:
+            r = {b: run(build_dir, b, stream, args) for b in BUILDS}
+            line = '%-6s %-12s' % (stream, name)
+            for b in BUILDS:
+                line += ' %6d %6d %5d %4d' % (r[b]['iter'], r[b]['end'], r[b]['naks'], r[b]['fail'])
+                total[b] += max(r[b]['iter'], r[b]['end'])
+            if r['static']['hash'] != r['gpio']['hash']:
+                line += '  read back differs'
+                bad += 1
+            print(line)
+    print('total iterations to finish: fixed %d, shared %d (%+.1f%%)' % (
+        total['static'], total['gpio'], 100.0 * (total['gpio'] - total['static']) / total['static']))
+    return 1 if bad else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
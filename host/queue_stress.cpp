@@ -0,0 +1,254 @@
+// Stress the USB core's packet queues and pools from two threads
+//
+// Usage: queue_stress [--seconds N] [--seed N]
+//
+// One thread plays the USB host and the USB interrupt. It sends numbered OUT
+// packets, takes IN packets, starts frames, and every so often purges the
+// device (FTDI request 0x00) or configures it again (SET_CONFIGURATION). Some
+// purges are made while the SIE is part way through sending an IN packet. Each
+// purge or configuration starts a new session, numbered in the packets too.
+// The main thread plays the sketch: it takes received packets with
+// usb_rx_batch() or usb_rx(), echoes each number back with usb_tx() or
+// usb_tx_batch(), and calls usb_rx_discard() when blaster_purge() is called.
+// usb_irq_mask() sections and usb_isr() exclude each other, as on the Teensy,
+// but everything else interleaves freely.
+//
+// The sketch must see the packets of a session in order with none missing,
+// and a new session start from its first packet. The host must see the echoes
+// in order with none repeated. No buffer may be handed out while it is still
+// held, and at the end every buffer but the armed receive ones must be free.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <set>
+#include <thread>
+#include "usb_dev.h"
+#include "usb_mem.h"
+#include "sim.h"
+
+static std::atomic<bool> bSending (true);
+static std::atomic<bool> bDone (false);
+static std::atomic<bool> bPurged (false);
+static std::atomic<long> nFail (0);
+
+static const int nPool[] = USB_POOL;
+
+#define FAIL(...) do { fprintf (stderr, "queue_stress: " __VA_ARGS__); ++nFail; } while (0)
+
+// Core callbacks
+uint8_t blaster_eeprom (uint16_t) { return 0; }
+void blaster_flush (void) {}
+void blaster_clock (uint16_t) {}
+void blaster_rx_ready (void) {}
+void blaster_purge (void) { bPurged = true; }
+void blaster_watchdog (void) { FAIL ("watchdog fired\n"); }
+
+// Not used, as there is no sketch
+void sim_pin_location (int, int *pPort, int *pBit) { *pPort = *pBit = 0; }
+int sim_signal_pin (int) { return 0; }
+void yield (void) {}
+
+struct Count
+{
+  long nOut = 0, nIn = 0, nPurge = 0, nConfig = 0, nRx = 0;
+};
+static Count count;
+
+static void put_number (uint8_t *p, uint16_t uSession, uint32_t uSeq)
+{
+  memcpy (p, &uSession, 2);
+  memcpy (p + 2, &uSeq, 4);
+}
+
+static void get_number (const uint8_t *p, uint16_t *pSession, uint32_t *pSeq)
+{
+  memcpy (pSession, p, 2);
+  memcpy (pSeq, p + 2, 4);
+}
+
+// The host and the USB interrupt
+static void bus_thread (unsigned int uSeed)
+{
+  std::mt19937 rng (uSeed);
+  uint16_t uSession = 0;
+  uint32_t uSeq = 0;
+  long nEcho = -1;                  // Last echo seen, as session << 32 | sequence
+  uint8_t uPkt[64];
+  while ( ! bDone )
+  {
+    unsigned int r = rng () % 10000;
+    int n;
+    if (( r < 5000 ) && bSending )
+    {
+      int nLen = 6 + rng () % 59;
+      memset (uPkt, 0x55, nLen);
+      put_number (uPkt, uSession, uSeq);
+      if ( sim_usb_out (uPkt, nLen) )
+      {
+        ++uSeq;
+        ++count.nOut;
+      }
+    }
+    else if ( r < 9000 )
+    {
+      // Now and then the host purges while the SIE is sending a packet
+      bool bSplit = bSending && ( rng () % 64 == 0 );
+      n = bSplit ? sim_usb_in_start (uPkt) : sim_usb_in (uPkt);
+      if ( bSplit && ( n >= 0 ))
+      {
+        sim_usb_setup (0x40, 0x00, 1, 0, 0);
+        ++count.nPurge;
+        ++uSession;
+        uSeq = 0;
+        sim_usb_in_end ();
+      }
+      if ( n > 0 )
+      {
+        uint16_t uS;
+        uint32_t uQ;
+        get_number (uPkt, &uS, &uQ);
+        long nNow = ((long)uS << 32 ) | uQ;
+        if (( n != 6 ) || ( nNow <= nEcho )) FAIL ("echo %u.%u after %ld.%ld\n", uS, uQ, nEcho >> 32, nEcho & 0xFFFFFFFF);
+        nEcho = nNow;
+        ++count.nIn;
+      }
+    }
+    else if ( r < 9990 ) sim_usb_sof ();
+    else if ( bSending )
+    {
+      if ( r < 9996 )
+      {
+        sim_usb_setup (0x40, 0x00, 1, 0, 0);
+        ++count.nPurge;
+      }
+      else
+      {
+        sim_usb_setup (0x00, 9, 1, 0, 0);
+        ++count.nConfig;
+      }
+      ++uSession;
+      uSeq = 0;
+    }
+    // Give the sketch a chance at the masked sections between transactions
+    std::this_thread::yield ();
+  }
+}
+
+int main (int argc, char **argv)
+{
+  double tRun = 2;
+  unsigned int uSeed = 1;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (( strcmp (argv[i], "--seconds") == 0 ) && ( i + 1 < argc )) tRun = atof (argv[++i]);
+    else if (( strcmp (argv[i], "--seed") == 0 ) && ( i + 1 < argc )) uSeed = atoi (argv[++i]);
+    else
+    {
+      fprintf (stderr, "Usage: queue_stress [--seconds N] [--seed N]\n");
+      return 2;
+    }
+  }
+
+  usb_init ();
+  sim_usb_reset ();
+  sim_irq_threaded (true);
+  std::thread bus (bus_thread, uSeed);
+
+  std::mt19937 rng (uSeed + 1);
+  std::set<usb_packet_t *> held;
+  usb_packet_t *prx[8];
+  usb_packet_t *ptx[8];
+  int nTx = 0;
+  long nSession = -1;
+  uint32_t uNext = 0;
+  auto tStart = std::chrono::steady_clock::now ();
+  auto tIdle = tStart;
+  while ( true )
+  {
+    auto tNow = std::chrono::steady_clock::now ();
+    if ( bSending && ( std::chrono::duration<double> (tNow - tStart).count () > tRun )) bSending = false;
+    if ( bPurged.exchange (false) ) usb_rx_discard (BLASTER_RX_EP);
+    // Now and then fall behind, so packets are waiting when the host purges
+    if ( rng () % 64 == 0 )
+    {
+      for (int k = 0; k < 200; ++k) std::this_thread::yield ();
+    }
+    uint32_t n;
+    if ( rng () & 1 ) n = usb_rx_batch (BLASTER_RX_EP, prx, 1 + rng () % 8);
+    else n = (( prx[0] = usb_rx (BLASTER_RX_EP) ) != NULL ) ? 1 : 0;
+    if ( n == 0 )
+    {
+      // Finished once the host has stopped sending and nothing more arrives
+      if ( bSending ) tIdle = tNow;
+      else if ( std::chrono::duration<double> (tNow - tIdle).count () > 0.2 ) break;
+      std::this_thread::yield ();
+      continue;
+    }
+    tIdle = tNow;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+      if ( ! held.insert (prx[i]).second ) FAIL ("received packet %p is already held\n", (void *)prx[i]);
+      uint16_t uS;
+      uint32_t uQ;
+      get_number (prx[i]->buf, &uS, &uQ);
+      if ( uS == nSession )
+      {
+        if ( uQ != uNext ) FAIL ("session %u: packet %u, expected %u\n", uS, uQ, uNext);
+      }
+      else if (( uS < nSession ) || ( uQ != 0 )) FAIL ("session %u packet %u after session %ld\n", uS, uQ, nSession);
+      nSession = uS;
+      uNext = uQ + 1;
+      ++count.nRx;
+      // Echo the number back. Only the transmit pool's own buffers are sure to
+      // be there, so send at least that often.
+      usb_packet_t *p;
+      while (( p = usb_malloc (BLASTER_TX_EP) ) == NULL ) std::this_thread::yield ();
+      if ( ! held.insert (p).second ) FAIL ("allocated packet %p is already held\n", (void *)p);
+      p->buf[0] = 0x31;
+      p->buf[1] = 0x60;
+      put_number (p->buf + 2, uS, uQ);
+      p->len = 8;
+      ptx[nTx++] = p;
+      held.erase (prx[i]);
+      usb_free (prx[i]);
+      if (( nTx == nPool[BLASTER_TX_EP - 1] ) || ( nTx == 8 ) || ( i + 1 == n ))
+      {
+        for (int k = 0; k < nTx; ++k) held.erase (ptx[k]);
+        if ( rng () & 1 ) usb_tx_batch (BLASTER_TX_EP, ptx, nTx);
+        else for (int k = 0; k < nTx; ++k) usb_tx (BLASTER_TX_EP, ptx[k]);
+        nTx = 0;
+      }
+    }
+  }
+  bDone = true;
+  bus.join ();
+  sim_irq_threaded (false);
+
+  // Take the last echoes, then let the receive endpoint be refilled
+  for (int i = 0; i < 100; ++i)
+  {
+    sim_usb_in (NULL);
+    sim_usb_sof ();
+  }
+  uint8_t uReply[( NUM_ENDPOINTS + 1 ) * sizeof (usb_pool_stats_t)];
+  int nReply = sim_usb_setup (0xC0, 0xA1, 0, 0, sizeof (uReply), uReply);
+  uint32_t nUsed = 0;
+  for (int k = 0; (int)sizeof (usb_pool_stats_t) * ( k + 1 ) <= nReply; ++k)
+  {
+    usb_pool_stats_t s;
+    memcpy (&s, uReply + sizeof (s) * k, sizeof (s));
+    nUsed += s.used;
+  }
+  if ( nUsed != 2 ) FAIL ("%u buffers in use at the end, expected the 2 receive buffers\n", nUsed);
+  SimIrqStats irq = sim_irq_stats ();
+  if ( irq.nDepth != 0 ) FAIL ("interrupts left masked\n");
+
+  printf ("out %ld, received %ld, discarded %ld, in %ld, purges %ld, configurations %ld, masked sections %ld: %s\n",
+    count.nOut, count.nRx, count.nOut - count.nRx, count.nIn, count.nPurge, count.nConfig, irq.nSections,
+    nFail ? "FAIL" : "ok");
+  return nFail ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+// Host simulation of the Teensy Blaster
+//
+// sim_gpio.cpp models the GPIO, SPI and DMA hardware the sketch drives and a
+// device on the JTAG port. sim_usb.cpp builds the USB core and plays the part
+// of the USB host. sim_sketch.cpp builds the sketch itself. Each is compiled
+// from the same sources as the Teensy build.
+
+#ifndef _sim_h_
+#define _sim_h_
+
+#include <stdint.h>
+#include <string>
+
+// ---- sim_gpio.cpp ----
+
+extern long sim_gpio_ops;           // GPIO register accesses, digitalWrite() and digitalRead()
+extern long sim_rising;             // TCK rising edges
+extern std::string sim_events;      // Log of TAP clocks and chip select changes
+
+// Start the device and the event log again, as for a new session
+void sim_device_reset (void);
+// TCK frequency in kHz at 120 MHz, mean and fastest, over the rising edges so far
+void sim_tck_khz (double *pMean, double *pFastest);
+
+// Provided by the sketch wrapper, or a dummy where there is no sketch
+void sim_pin_location (int pin, int *pPort, int *pBit);
+int sim_signal_pin (int iSig);      // 0 TCK, 1 TMS, 2 NCE, 3 NCS, 4 TDI, 5 TDO, 6 ASO
+
+// ---- sim_usb.cpp ----
+
+struct SimUsbStats
+{
+  long nOut;                        // OUT packets accepted
+  long nNak;                        // OUT packets refused for want of a buffer
+  long nIn;                         // IN packets taken, including empty ones
+  long nEmpty;                      // IN packets with just the two status bytes
+  long nInHist[65];                 // IN packets by length
+};
+extern SimUsbStats sim_usb_stats;
+
+// Interrupt masking. Sections are counted and timed with the host clock, as a
+// rough guide to how long the Teensy would keep the USB interrupt waiting.
+struct SimIrqStats
+{
+  long nSections;                   // Outermost masked sections
+  double tTotal;                    // ns
+  double tMax;                      // ns
+  long nAll;                        // Of those, sections that would mask every interrupt
+  double tAllMax;                   // on the Teensy 3.5, and the longest (ns)
+  int nDepth;                       // Now, so 0 when balanced
+};
+SimIrqStats sim_irq_stats (void);
+void sim_irq_reset_max (void);      // Start timing the longest section again
+// Run usb_isr() and the sketch's software interrupt on another thread, with
+// the masked sections excluding them, as for queue_stress
+void sim_irq_threaded (bool bThreaded);
+
+void sim_usb_reset (void);          // Bus reset, then SET_CONFIGURATION 1
+void sim_usb_sof (void);            // Start of frame, also a 1 ms SysTick
+void sim_usb_isr (void);            // usb_isr(), then any pending software interrupt
+void sim_swi (void);                // Any pending software interrupt
+
+// A control request. For IN requests up to wLength bytes are copied to pReply.
+// Returns the number of bytes in the reply.
+int sim_usb_setup (uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+  uint16_t wIndex, uint16_t wLength, uint8_t *pReply = nullptr);
+// An OUT packet to the Blaster. Returns false for a NAK.
+bool sim_usb_out (const uint8_t *pData, int nLen);
+// An IN request to the Blaster. Returns the length taken, or -1 for a NAK.
+// The 0x31 0x60 status bytes are checked and not copied.
+int sim_usb_in (uint8_t *pData);
+// The same in two steps, for requests made while the SIE is sending the packet
+int sim_usb_in_start (uint8_t *pData);
+void sim_usb_in_end (void);
+
+// Watchdog trips so far, read with vendor request 0xA2
+uint32_t sim_usb_watchdog_trips (void);
+
+#endif
@@ -0,0 +1,230 @@
+// GPIO, SPI and DMA models, and the device on the JTAG port
+//
+// The device is a 41 bit shift register clocked by TCK, fed from TDI and TMS,
+// with its low bit on TDO, and a 16 bit LFSR on ASO. Both outputs change on
+// the falling edge of TCK, as a real TAP does. Each TCK rising edge adds a
+// letter for TMS and TDI to sim_events, and each change of nCE or nCS a pair,
+// so two builds drove the pins the same way if their event logs match.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "kinetis.h"
+#include "Arduino.h"
+#include "SPI.h"
+#include "DMAChannel.h"
+#include "sim.h"
+
+enum { SIG_TCK, SIG_TMS, SIG_NCE, SIG_NCS, SIG_TDI, SIG_TDO, SIG_ASO };
+
+static uint32_t uOut[5];            // Port data output
+static uint32_t uIn[5];             // Port data input
+static uint32_t uDir[5];            // Port data direction
+
+long sim_gpio_ops = 0;
+long sim_rising = 0;
+std::string sim_events;
+uint32_t sim_cycles = 0;
+volatile uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+volatile uint32_t sim_pcr[5][32];
+volatile uint32_t SIM_SCGC4, SIM_SCGC6, PIT_MCR;
+volatile uint8_t DMAMUX0_CHCFG0;
+sim_pit_channel_t KINETISK_PIT_CHANNELS[4];
+long sim_spi_bytes = 0;
+long sim_dma_runs = 0;
+SPIClass SPI;
+
+GpioReg gpio_regs[5][6] = {
+  {{0, 0}, {0, 1}, {0, 2}, {0, 3}, {0, 4}, {0, 5}},
+  {{1, 0}, {1, 1}, {1, 2}, {1, 3}, {1, 4}, {1, 5}},
+  {{2, 0}, {2, 1}, {2, 2}, {2, 3}, {2, 4}, {2, 5}},
+  {{3, 0}, {3, 1}, {3, 2}, {3, 3}, {3, 4}, {3, 5}},
+  {{4, 0}, {4, 1}, {4, 2}, {4, 3}, {4, 4}, {4, 5}},
+};
+
+// ---- Device model ----
+
+static uint64_t uShiftReg = 0x123456789ull;
+static uint32_t uLfsr = 0xACE1;
+static int bLastTck = 0;
+static int bLastNce = 1;
+static int bLastNcs = 1;
+static uint32_t tLastRise = 0;
+static uint32_t tMinPeriod = ~0u;
+static double tSumPeriod = 0;
+static long nPeriod = 0;
+
+static int signal (int iSig)
+{
+  int iPort, iBit;
+  sim_pin_location (sim_signal_pin (iSig), &iPort, &iBit);
+  return ( uOut[iPort] >> iBit ) & 1;
+}
+
+static void set_input (int iSig, int bHigh)
+{
+  int iPort, iBit;
+  sim_pin_location (sim_signal_pin (iSig), &iPort, &iBit);
+  if ( bHigh ) uIn[iPort] |= 1u << iBit;
+  else uIn[iPort] &= ~( 1u << iBit );
+}
+
+static void pins_changed (void)
+{
+  int bTck = signal (SIG_TCK);
+  if (( signal (SIG_NCE) != bLastNce ) || ( signal (SIG_NCS) != bLastNcs ))
+  {
+    bLastNce = signal (SIG_NCE);
+    bLastNcs = signal (SIG_NCS);
+    sim_events += 'C';
+    sim_events += char ('0' + 2 * bLastNce + bLastNcs);
+  }
+  if ( bTck && ! bLastTck )
+  {
+    ++sim_rising;
+    if ( tLastRise )
+    {
+      // Gaps of more than 100000 cycles are between commands, not TCK periods
+      uint32_t tPeriod = sim_cycles - tLastRise;
+      if ( tPeriod < 100000 )
+      {
+        tSumPeriod += tPeriod;
+        ++nPeriod;
+        if ( tPeriod < tMinPeriod ) tMinPeriod = tPeriod;
+      }
+    }
+    tLastRise = sim_cycles;
+    int bTms = signal (SIG_TMS);
+    int bTdi = signal (SIG_TDI);
+    sim_events += char ('a' + 2 * bTms + bTdi);
+    uShiftReg = ( uShiftReg >> 1 ) | ((uint64_t)bTdi << 40 ) | ((uint64_t)bTms << 39 );
+    uLfsr = ( uLfsr >> 1 ) ^ (( uLfsr & 1 ) ? 0xB400 : 0 );
+  }
+  if ( ! bTck && bLastTck )
+  {
+    set_input (SIG_TDO, uShiftReg & 1);
+    set_input (SIG_ASO, uLfsr & 1);
+  }
+  bLastTck = bTck;
+}
+
+void sim_device_reset (void)
+{
+  uShiftReg = 0x123456789ull;
+  uLfsr = 0xACE1;
+  set_input (SIG_TDO, 0);
+  set_input (SIG_ASO, 0);
+  sim_events.clear ();
+}
+
+void sim_tck_khz (double *pMean, double *pFastest)
+{
+  *pMean = nPeriod ? F_CPU / 1000.0 * nPeriod / tSumPeriod : 0;
+  *pFastest = nPeriod ? F_CPU / 1000.0 / tMinPeriod : 0;
+}
+
+// ---- GPIO ----
+
+GpioReg &GpioReg::operator= (uint32_t x)
+{
+  ++sim_gpio_ops;
+  sim_cycles += 3;
+  switch ( kind )
+  {
+    case 0: uOut[port] = x; break;
+    case 1: uOut[port] |= x; break;
+    case 2: uOut[port] &= ~x; break;
+    case 3: uOut[port] ^= x; break;
+    case 5: uDir[port] = x; break;
+  }
+  pins_changed ();
+  return *this;
+}
+
+GpioReg::operator uint32_t () const
+{
+  ++sim_gpio_ops;
+  if ( kind == 4 ) return uIn[port];
+  if ( kind == 5 ) return uDir[port];
+  return uOut[port];
+}
+
+void pinMode (uint8_t pin, uint8_t mode)
+{
+  int iPort, iBit;
+  sim_pin_location (pin, &iPort, &iBit);
+  if ( mode == OUTPUT ) uDir[iPort] |= 1u << iBit;
+  else uDir[iPort] &= ~( 1u << iBit );
+}
+
+void digitalWrite (uint8_t pin, uint8_t val)
+{
+  int iPort, iBit;
+  sim_pin_location (pin, &iPort, &iBit);
+  ++sim_gpio_ops;
+  if ( val ) uOut[iPort] |= 1u << iBit;
+  else uOut[iPort] &= ~( 1u << iBit );
+  pins_changed ();
+}
+
+uint8_t digitalRead (uint8_t pin)
+{
+  int iPort, iBit;
+  sim_pin_location (pin, &iPort, &iBit);
+  ++sim_gpio_ops;
+  return ( uIn[iPort] >> iBit ) & 1;
+}
+
+// ---- SPI0: mode 0, LSB first, on the TCK, TDI and TDO pins ----
+
+void SPIClass::transfer (const void *pSend, void *pRecv, size_t nByte)
+{
+  const uint8_t *pS = (const uint8_t *)pSend;
+  uint8_t *pR = (uint8_t *)pRecv;
+  int iTckPort, iTckBit, iTdiPort, iTdiBit, iTdoPort, iTdoBit;
+  sim_pin_location (sim_signal_pin (SIG_TCK), &iTckPort, &iTckBit);
+  sim_pin_location (sim_signal_pin (SIG_TDI), &iTdiPort, &iTdiBit);
+  sim_pin_location (sim_signal_pin (SIG_TDO), &iTdoPort, &iTdoBit);
+  if ( sim_pcr[iTckPort][iTckBit] != ( PORT_PCR_DSE | PORT_PCR_MUX (2) ))
+  {
+    fprintf (stderr, "SPI: TCK is not muxed to SPI0\n");
+    exit (1);
+  }
+  if ( signal (SIG_TCK) )
+  {
+    fprintf (stderr, "SPI: started with TCK high\n");
+    exit (1);
+  }
+  for (size_t i = 0; i < nByte; ++i)
+  {
+    uint8_t uSend = pS[i];
+    uint8_t uRecv = 0;
+    for (int j = 0; j < 8; ++j)
+    {
+      if ( uSend & 1 ) uOut[iTdiPort] |= 1u << iTdiBit;
+      else uOut[iTdiPort] &= ~( 1u << iTdiBit );
+      pins_changed ();
+      uOut[iTckPort] |= 1u << iTckBit;
+      pins_changed ();
+      uRecv >>= 1;
+      if (( uIn[iTdoPort] >> iTdoBit ) & 1 ) uRecv |= 0x80;
+      uOut[iTckPort] &= ~( 1u << iTckBit );
+      pins_changed ();
+      uSend >>= 1;
+    }
+    if ( pR != NULL ) pR[i] = uRecv;
+  }
+  sim_spi_bytes += nByte;
+}
+
+// ---- DMA: each PIT period captures the inputs, then writes the next output byte ----
+
+void sim_dma_run (const GpioReg *pIn, uint8_t *pCap, const uint8_t *pOut, const GpioReg *pOutReg, int nXfer)
+{
+  ++sim_dma_runs;
+  for (int i = 0; i < nXfer; ++i)
+  {
+    pCap[i] = (uint8_t)uIn[pIn->port];
+    uOut[pOutReg->port] = ( uOut[pOutReg->port] & ~0xFFu ) | pOut[i];
+    pins_changed ();
+  }
+}
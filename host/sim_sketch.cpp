@@ -0,0 +1,37 @@
+// The sketch built for the host, from its host build copy (see hostify.cmake)
+
+#include "Arduino.h"
+#include "Teensy_Blaster.ino"
+#include "sim.h"
+
+// Port (A = 0) and bit of Teensy 3.5 pins 0 - 39, so the model does not
+// depend on the sketch having a pin map of its own
+static const uint8_t uBoardPins[40][2] = {
+  {1, 16}, {1, 17}, {3,  0}, {0, 12}, {0, 13}, {3,  7}, {3,  4}, {3,  2},
+  {3,  3}, {2,  3}, {2,  4}, {2,  6}, {2,  7}, {2,  5}, {3,  1}, {2,  0},
+  {1,  0}, {1,  1}, {1,  3}, {1,  2}, {3,  5}, {3,  6}, {2,  1}, {2,  2},
+  {4, 26}, {0,  5}, {0, 14}, {0, 15}, {0, 16}, {1, 18}, {1, 19}, {1, 10},
+  {1, 11}, {4, 24}, {4, 25}, {2,  8}, {2,  9}, {2, 10}, {2, 11}, {0, 17},
+};
+
+void sim_pin_location (int pin, int *pPort, int *pBit)
+{
+  *pPort = uBoardPins[pin][0];
+  *pBit = uBoardPins[pin][1];
+}
+
+int sim_signal_pin (int iSig)
+{
+  static const int iPin[] = { PIN_TCK, PIN_TMS, PIN_NCE, PIN_NCS, PIN_TDI, PIN_TDO, PIN_ASO };
+  return iPin[iSig];
+}
+
+void sim_sketch_setup (void)
+{
+  setup ();
+}
+
+void sim_sketch_loop (void)
+{
+  loop ();
+}
@@ -0,0 +1,305 @@
+// The USB core built for the host, and a model of the USB host driving it
+//
+// usb_mem.c and usb_dev.c are included from their host build copies (see
+// hostify.cmake), so the bus model can reach the buffer descriptor table. A
+// token is modelled by filling in its buffer descriptor the way the SIE would,
+// setting TOKDNE and calling usb_isr(). Data toggles are not checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include "kinetis.h"
+#include "HardwareSerial.h"
+#include "sim.h"
+
+W1C usb0_istat;
+char sim_anchor[16];
+volatile uint8_t usb0_endpt[64];
+volatile uint8_t USB0_STAT, USB0_CTL, USB0_ADDR, USB0_ERRSTAT, USB0_ERREN, USB0_INTEN;
+volatile uint8_t USB0_BDTPAGE1, USB0_BDTPAGE2, USB0_BDTPAGE3, USB0_OTGISTAT;
+volatile uint8_t USB0_USBCTRL, USB0_CONTROL, USB0_USBTRC0;
+volatile uint32_t systick_millis_count;
+HardwareSerial2 Serial2;
+
+uint32_t millis (void)
+{
+  return systick_millis_count;
+}
+
+int HardwareSerial2::printf (const char *psFmt, ...)
+{
+  va_list va;
+  va_start (va, psFmt);
+  int n = vfprintf (stderr, psFmt, va);
+  va_end (va);
+  return n;
+}
+
+extern "C" void serial2_write (const void *buf, unsigned int count)
+{
+  fwrite (buf, 1, count, stderr);
+}
+
+// ---- Interrupt masking ----
+
+typedef std::chrono::steady_clock Clock;
+static bool bThreaded = false;
+static std::recursive_mutex mIrq;          // Held by usb_isr() and masked sections when threaded
+static thread_local int nDepth = 0;
+static thread_local Clock::time_point tMasked;
+static thread_local bool bAll;              // The section masks every interrupt on the Teensy 3.5
+static SimIrqStats irqStats;
+
+static void irq_mask (bool bEvery)
+{
+  if ( bThreaded ) mIrq.lock ();
+  if ( nDepth++ == 0 )
+  {
+    tMasked = Clock::now ();
+    bAll = false;
+  }
+  bAll |= bEvery;
+}
+
+extern "C" void sim_disable_irq (void)
+{
+  irq_mask (true);
+}
+
+extern "C" uint32_t sim_usb_irq_mask (void)
+{
+  irq_mask (false);
+  return 0;
+}
+
+extern "C" uint32_t sim_pool_irq_mask (void)
+{
+  irq_mask (false);
+  return 0;
+}
+
+extern "C" void sim_irq_restore (uint32_t)
+{
+  sim_enable_irq ();
+}
+
+extern "C" void sim_enable_irq (void)
+{
+  if ( --nDepth == 0 )
+  {
+    double t = std::chrono::duration<double, std::nano> (Clock::now () - tMasked).count ();
+    ++irqStats.nSections;
+    irqStats.tTotal += t;
+    if ( t > irqStats.tMax ) irqStats.tMax = t;
+    if ( bAll )
+    {
+      ++irqStats.nAll;
+      if ( t > irqStats.tAllMax ) irqStats.tAllMax = t;
+    }
+  }
+  if ( bThreaded ) mIrq.unlock ();
+}
+
+SimIrqStats sim_irq_stats (void)
+{
+  SimIrqStats st = irqStats;
+  st.nDepth = nDepth;
+  return st;
+}
+
+void sim_irq_reset_max (void)
+{
+  irqStats.tMax = 0;
+  irqStats.tAllMax = 0;
+}
+
+void sim_irq_threaded (bool b)
+{
+  bThreaded = b;
+}
+
+// When threaded, each bus transaction is one step as far as the masked sections
+// are concerned, as it is for the SIE
+struct BusLock
+{
+  BusLock () { if ( bThreaded ) mIrq.lock (); }
+  ~BusLock () { if ( bThreaded ) mIrq.unlock (); }
+};
+
+// ---- The USB core ----
+
+#include "usb_mem.c"
+#include "usb_dev.c"
+
+const uint8_t usb_endpoint_config_table[NUM_ENDPOINTS] = { ENDPOINT1_CONFIG, ENDPOINT2_CONFIG };
+const usb_descriptor_list_t usb_descriptor_list[] = { {0, 0, NULL, 0} };
+void usb_init_serialnumber (void) {}
+
+// ---- Software interrupt, below USB ----
+
+int sim_swi_pending = 0;
+void (*sim_swi_vector) (void) = NULL;
+static thread_local bool bSwiActive = false;
+
+void sim_swi (void)
+{
+  if ( bSwiActive || ( sim_swi_vector == NULL )) return;
+  bSwiActive = true;
+  while ( sim_swi_pending )
+  {
+    sim_swi_pending = 0;
+    sim_swi_vector ();
+  }
+  bSwiActive = false;
+}
+
+void sim_usb_isr (void)
+{
+  {
+    // Sections masked by the interrupt itself are not counted
+    std::unique_lock<std::recursive_mutex> lock (mIrq, std::defer_lock);
+    if ( bThreaded ) lock.lock ();
+    ++nDepth;
+    usb_isr ();
+    --nDepth;
+  }
+  sim_swi ();
+}
+
+// ---- The USB host ----
+
+SimUsbStats sim_usb_stats;
+static int iEp0RxOdd = 0;
+static int iEp0TxOdd = 0;
+static int iRxOdd = 0;
+static int iTxOdd = 0;
+
+static void token (int iEP, int iTx, int iOdd, int iPid, int nLen)
+{
+  bdt_t *b = &table[index (iEP, iTx, iOdd)];
+  b->desc = ( b->desc & 0x0000FF40 ) | ((uint32_t)nLen << 16 ) | ( iPid << 2 );
+  b->desc &= ~ BDT_OWN;
+  USB0_STAT = ( iEP << 4 ) | ( iTx << 3 ) | ( iOdd << 2 );
+  usb0_istat.v |= USB_ISTAT_TOKDNE;
+  sim_usb_isr ();
+}
+
+void sim_usb_reset (void)
+{
+  BusLock lock;
+  usb0_istat.v |= USB_ISTAT_USBRST;
+  sim_usb_isr ();
+  iEp0RxOdd = iEp0TxOdd = iRxOdd = iTxOdd = 0;
+  sim_usb_setup (0x00, 9, 1, 0, 0);
+}
+
+void sim_usb_sof (void)
+{
+  BusLock lock;
+  ++systick_millis_count;
+  usb0_istat.v |= USB_ISTAT_SOFTOK;
+  sim_usb_isr ();
+}
+
+int sim_usb_setup (uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+  uint16_t wIndex, uint16_t wLength, uint8_t *pReply)
+{
+  BusLock lock;
+  uint8_t uSetup[8] = { bmRequestType, bRequest, (uint8_t)wValue, (uint8_t)( wValue >> 8 ),
+    (uint8_t)wIndex, (uint8_t)( wIndex >> 8 ), (uint8_t)wLength, (uint8_t)( wLength >> 8 ) };
+  bdt_t *b = &table[index (0, RX, iEp0RxOdd)];
+  if ( ! ( b->desc & BDT_OWN ))
+  {
+    fprintf (stderr, "sim_usb_setup: no endpoint 0 receive buffer\n");
+    exit (1);
+  }
+  memcpy ((void *)b->addr, uSetup, 8);
+  token (0, RX, iEp0RxOdd, 0x0D, 8);
+  iEp0RxOdd ^= 1;
+  // Data stage for an IN request, or the status stage for an OUT request
+  int nReply = 0;
+  for (;;)
+  {
+    b = &table[index (0, TX, iEp0TxOdd)];
+    if ( ! ( b->desc & BDT_OWN )) break;
+    int nLen = b->desc >> 16;
+    if (( pReply != NULL ) && ( nReply + nLen <= wLength )) memcpy (pReply + nReply, (void *)b->addr, nLen);
+    nReply += nLen;
+    token (0, TX, iEp0TxOdd, 0x09, nLen);
+    iEp0TxOdd ^= 1;
+    if ( nLen < EP0_SIZE ) break;
+  }
+  if ( bmRequestType & 0x80 )
+  {
+    // Status stage
+    token (0, RX, iEp0RxOdd, 0x01, 0);
+    iEp0RxOdd ^= 1;
+  }
+  return nReply;
+}
+
+bool sim_usb_out (const uint8_t *pData, int nLen)
+{
+  BusLock lock;
+  bdt_t *b = &table[index (BLASTER_RX_EP, RX, iRxOdd)];
+  if ( ! ( b->desc & BDT_OWN ))
+  {
+    ++sim_usb_stats.nNak;
+    return false;
+  }
+  memcpy ((void *)b->addr, pData, nLen);
+  token (BLASTER_RX_EP, RX, iRxOdd, 0x01, nLen);
+  iRxOdd ^= 1;
+  ++sim_usb_stats.nOut;
+  return true;
+}
+
+static int nInFlight = 0;          // Length of the IN packet the SIE is sending, or 0
+
+int sim_usb_in_start (uint8_t *pData)
+{
+  BusLock lock;
+  bdt_t *b = &table[index (BLASTER_TX_EP, TX, iTxOdd)];
+  if ( ! ( b->desc & BDT_OWN )) return -1;
+  int nLen = b->desc >> 16;
+  const uint8_t *p = (const uint8_t *)b->addr;
+  if (( nLen < 2 ) || ( nLen > 64 ) || ( p[0] != 0x31 ) || ( p[1] != 0x60 ))
+  {
+    fprintf (stderr, "sim_usb_in: bad packet, %d bytes\n", nLen);
+    exit (1);
+  }
+  if ( pData != NULL ) memcpy (pData, p + 2, nLen - 2);
+  ++sim_usb_stats.nIn;
+  ++sim_usb_stats.nInHist[nLen];
+  if ( nLen == 2 ) ++sim_usb_stats.nEmpty;
+  nInFlight = nLen;
+  return nLen - 2;
+}
+
+void sim_usb_in_end (void)
+{
+  BusLock lock;
+  token (BLASTER_TX_EP, TX, iTxOdd, 0x09, nInFlight);
+  iTxOdd ^= 1;
+  nInFlight = 0;
+}
+
+int sim_usb_in (uint8_t *pData)
+{
+  BusLock lock;
+  int n = sim_usb_in_start (pData);
+  if ( n >= 0 ) sim_usb_in_end ();
+  return n;
+}
+
+uint32_t sim_usb_watchdog_trips (void)
+{
+  uint8_t uReply[64];
+  if ( sim_usb_setup (0xC0, 0xA2, 0, 0, 4, uReply) < 4 ) return 0;
+  uint32_t uTrips;
+  memcpy (&uTrips, uReply, 4);
+  return uTrips;
+}
@@ -0,0 +1,26 @@
+// Host build stand-in for the Teensyduino Arduino.h
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "kinetis.h"
+#include "HardwareSerial.h"
+
+#define HIGH            1
+#define LOW             0
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+#define LSBFIRST        0
+#define MSBFIRST        1
+
+void pinMode (uint8_t pin, uint8_t mode);
+void digitalWrite (uint8_t pin, uint8_t val);
+uint8_t digitalRead (uint8_t pin);
+uint32_t millis (void);
+void yield (void);
+
+#endif
@@ -0,0 +1,59 @@
+// Host build stand-in for the Teensyduino DMAChannel library, just enough for
+// the sketch's DMA byte shift. A capture channel linked to an output channel
+// is run to completion by enable(), one PIT period per transfer
+// (sim_gpio.cpp), so the waveform and captured inputs are as on the Teensy.
+
+#ifndef DMAChannel_h_
+#define DMAChannel_h_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "kinetis.h"
+
+#define DMAMUX_ENABLE           0x80
+#define DMAMUX_TRIG             0x40
+#define DMAMUX_SOURCE_ALWAYS0   54
+extern volatile uint8_t DMAMUX0_CHCFG0;
+
+void sim_dma_run (const GpioReg *pIn, uint8_t *pCap, const uint8_t *pOut, const GpioReg *pOutReg, int nXfer);
+extern long sim_dma_runs;
+
+class DMAChannel
+{
+public:
+  uint8_t channel = 0;
+
+  // The sketch passes the low byte of a GPIO register, which is a GpioReg here
+  void source (volatile uint8_t &r) { pSrc = (void *)&r; }
+  void destination (volatile uint8_t &r) { pDst = (void *)&r; }
+  void sourceBuffer (const uint8_t *p, unsigned int n) { pSrc = (void *)p; nXfer = n; }
+  void destinationBuffer (uint8_t *p, unsigned int n) { pDst = (void *)p; nXfer = n; }
+  void disableOnCompletion (void) {}
+  void triggerAtTransfersOf (DMAChannel &ch) { ch.pMinor = this; }
+  void triggerAtCompletionOf (DMAChannel &ch) { ch.pMajor = this; }
+  bool complete (void) { return bDone; }
+  void clearComplete (void) { bDone = false; }
+  void enable (void)
+  {
+    // Only the capture channel is enabled, and it drives the output channel
+    if (( pMinor == NULL ) || ( pMinor != pMajor ) || ( pMinor->nXfer != nXfer ))
+    {
+      fprintf (stderr, "DMAChannel: unsupported channel setup\n");
+      exit (1);
+    }
+    sim_dma_run ((const GpioReg *)pSrc, (uint8_t *)pDst, (const uint8_t *)pMinor->pSrc,
+      (const GpioReg *)pMinor->pDst, nXfer);
+    bDone = pMinor->bDone = true;
+  }
+
+private:
+  void *pSrc = NULL;
+  void *pDst = NULL;
+  int nXfer = 0;
+  bool bDone = false;
+  DMAChannel *pMinor = NULL;
+  DMAChannel *pMajor = NULL;
+};
+
+#endif
@@ -0,0 +1,28 @@
+// Host build stand-in for the Teensyduino HardwareSerial.h. Serial2 output
+// goes to stderr.
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include <stdint.h>
+
+#define SERIAL_8N1      0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void serial2_write (const void *buf, unsigned int count);
+#ifdef __cplusplus
+}
+
+class HardwareSerial2
+{
+public:
+  void begin (uint32_t, uint32_t = SERIAL_8N1) {}
+  int available (void) { return 0; }
+  int printf (const char *psFmt, ...) __attribute__ ((format (printf, 2, 3)));
+};
+extern HardwareSerial2 Serial2;
+#endif
+
+#endif
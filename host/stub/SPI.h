@@ -0,0 +1,34 @@
+// Host build stand-in for the Teensyduino SPI library. transfer() clocks the
+// bytes bit by bit on the simulated pins (sim_gpio.cpp), as SPI mode 0 LSB first.
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPI_MODE0       0
+
+class SPISettings
+{
+public:
+  SPISettings (uint32_t uClock, uint8_t, uint8_t) : uClock (uClock) {}
+  SPISettings (void) : uClock (4000000) {}
+  uint32_t uClock;
+};
+
+class SPIClass
+{
+public:
+  void setSCK (uint8_t) {}
+  void setMOSI (uint8_t) {}
+  void setMISO (uint8_t) {}
+  void begin (void) {}
+  void beginTransaction (SPISettings) {}
+  void endTransaction (void) {}
+  void transfer (const void *pSend, void *pRecv, size_t nByte);
+};
+extern SPIClass SPI;
+extern long sim_spi_bytes;
+
+#endif
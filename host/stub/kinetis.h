@@ -0,0 +1,137 @@
+// Host build stand-in for the Teensyduino kinetis.h
+//
+// Only the registers used by usb_dev.c, usb_mem.c and the sketch are defined.
+// Most are plain variables. The GPIO and USB interrupt status registers are
+// proxies, so the simulation sees every write (sim_gpio.cpp, sim_usb.cpp).
+
+#ifndef _kinetis_h_
+#define _kinetis_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define F_BUS               60000000
+
+#ifdef __cplusplus
+// USB0_ISTAT is write 1 to clear
+struct W1C
+{
+  volatile uint8_t v;
+  W1C &operator= (uint8_t x) { v &= ~x; return *this; }
+  operator uint8_t () const { return v; }
+};
+extern W1C usb0_istat;
+#define USB0_ISTAT          usb0_istat
+
+// GPIO register proxy: every access is counted, and writes update the pins
+struct GpioReg
+{
+  int port;
+  int kind;                 // 0 PDOR, 1 PSOR, 2 PCOR, 3 PTOR, 4 PDIR, 5 PDDR
+  GpioReg &operator= (uint32_t x);
+  operator uint32_t () const;
+  GpioReg &operator|= (uint32_t x) { return *this = (uint32_t)*this | x; }
+  GpioReg &operator&= (uint32_t x) { return *this = (uint32_t)*this & x; }
+};
+extern GpioReg gpio_regs[5][6];
+
+// A buffer descriptor address. The core finds the odd bank of a descriptor from
+// bit 3 of its address, so the table needs 8 byte entries. This stores a 32 bit
+// offset from sim_anchor instead of a 64 bit pointer.
+extern char sim_anchor[16];
+struct HostPtr
+{
+  int32_t off;
+  HostPtr &operator= (const void *p) { off = p ? (int32_t)((const char *)p - sim_anchor) : 0; return *this; }
+  template <class T> operator T * () const { return off ? (T *)(sim_anchor + off) : (T *)0; }
+  operator bool () const { return off != 0; }
+};
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// USB-OTG - 46.4 in the K64 manual
+extern volatile uint8_t usb0_endpt[64];
+extern volatile uint8_t USB0_STAT, USB0_CTL, USB0_ADDR, USB0_ERRSTAT, USB0_ERREN, USB0_INTEN;
+extern volatile uint8_t USB0_BDTPAGE1, USB0_BDTPAGE2, USB0_BDTPAGE3, USB0_OTGISTAT;
+extern volatile uint8_t USB0_USBCTRL, USB0_CONTROL, USB0_USBTRC0;
+extern volatile uint32_t SIM_SCGC4, SIM_SCGC6;
+#define USB0_ENDPT0                 (usb0_endpt[0])
+#define USB0_ENDPT1                 (usb0_endpt[4])
+#define USB_ISTAT_USBRST            0x01
+#define USB_ISTAT_ERROR             0x02
+#define USB_ISTAT_SOFTOK            0x04
+#define USB_ISTAT_TOKDNE            0x08
+#define USB_ISTAT_SLEEP             0x10
+#define USB_ISTAT_STALL             0x80
+#define USB_CTL_USBENSOFEN          0x01
+#define USB_CTL_ODDRST              0x02
+#define USB_ENDPT_EPHSHK            0x01
+#define USB_ENDPT_EPSTALL           0x02
+#define USB_ENDPT_EPTXEN            0x04
+#define USB_ENDPT_EPRXEN            0x08
+#define USB_INTEN_USBRSTEN          0x01
+#define USB_INTEN_ERROREN           0x02
+#define USB_INTEN_SOFTOKEN          0x04
+#define USB_INTEN_TOKDNEEN          0x08
+#define USB_INTEN_SLEEPEN           0x10
+#define USB_INTEN_STALLEN           0x80
+#define USB_CONTROL_DPPULLUPNONOTG  0x10
+#define SIM_SCGC4_USBOTG            0x40000
+#define SIM_SCGC6_PIT               0x800000
+
+// Interrupts. Masking is counted, and timed by sim_usb.cpp. hostify.cmake
+// points the core's usb_irq_mask() calls, which on the Teensy 3.5 raise BASEPRI
+// rather than mask everything, at sim_usb_irq_mask(), and the Cortex-M0+ pool
+// sections, which the Teensy 3.5 does not have, at sim_pool_irq_mask().
+void sim_disable_irq (void);
+void sim_enable_irq (void);
+uint32_t sim_usb_irq_mask (void);
+uint32_t sim_pool_irq_mask (void);
+void sim_irq_restore (uint32_t saved);
+#define __disable_irq()             sim_disable_irq ()
+#define __enable_irq()              sim_enable_irq ()
+#define IRQ_USBOTG                  53
+#define IRQ_SOFTWARE                70
+#define NVIC_SET_PRIORITY(irq, p)   do {} while (0)
+#define NVIC_ENABLE_IRQ(irq)        do {} while (0)
+extern int sim_swi_pending;
+extern void (*sim_swi_vector) (void);
+#define NVIC_SET_PENDING(irq)       (sim_swi_pending = 1)
+#define attachInterruptVector(irq, f) (sim_swi_vector = (f))
+
+// DWT cycle counter. Simulated time moves on 2 cycles per read and 3 per GPIO write.
+extern uint32_t sim_cycles;
+extern volatile uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+static inline uint32_t sim_cyccnt (void) { return sim_cycles += 2; }
+#define ARM_DWT_CYCCNT              sim_cyccnt ()
+#define ARM_DEMCR_TRCENA            0x01000000
+#define ARM_DWT_CTRL_CYCCNTENA      1
+
+// PORT pin control - 12.5 in the K64 manual
+extern volatile uint32_t sim_pcr[5][32];
+#define PORT_PCR_MUX(n)             ((n) << 8)
+#define PORT_PCR_DSE                0x40
+#define PORT_PCR_SRE                0x04
+#define PORT_PCR_PE                 0x02
+#define PORT_PCR_PS                 0x01
+
+// PIT - 41.4 in the K64 manual
+typedef struct
+{
+  volatile uint32_t LDVAL, CVAL, TCTRL, TFLG;
+} sim_pit_channel_t;
+extern sim_pit_channel_t KINETISK_PIT_CHANNELS[4];
+extern volatile uint32_t PIT_MCR;
+#define PIT_TCTRL_TEN               1
+
+extern volatile uint32_t systick_millis_count;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+// Teensy 3.5 pin to GPIO port mapping
+// Derived from the pin assignments in core_pins.h (Teensyduino 1.52)
+
+#ifndef PINMAP_H
+#define PINMAP_H
+
+#include <stdint.h>
+
+// GPIO ports
+#define GPIO_A      0
+#define GPIO_B      1
+#define GPIO_C      2
+#define GPIO_D      3
+#define GPIO_E      4
+
+// GPIO registers for a port - 55.2 in Teensy 3.5 hardware manual
+#define GPIO_REG(port, offset)  (*(volatile uint32_t *)(0x400FF000 + 0x40 * (port) + (offset)))
+#define GPIO_PDOR(port)         GPIO_REG (port, 0x00)   // Port Data Output
+#define GPIO_PSOR(port)         GPIO_REG (port, 0x04)   // Port Set Output
+#define GPIO_PCOR(port)         GPIO_REG (port, 0x08)   // Port Clear Output
+#define GPIO_PTOR(port)         GPIO_REG (port, 0x0C)   // Port Toggle Output
+#define GPIO_PDIR(port)         GPIO_REG (port, 0x10)   // Port Data Input
+
+// Pin control register for a port bit - 12.5 in Teensy 3.5 hardware manual
+#define PORT_PCR(port, bit)     (*(volatile uint32_t *)(0x40049000 + 0x1000 * (port) + 4 * (bit)))
+
+struct PinMap
+{
+  uint8_t port;
+  uint8_t bit;
+};
+
+// Indexed by Teensy pin number. Only the pins on the two outer rows
+// of the board (0 - 39) are included.
+static constexpr PinMap pin_map[] = {
+  {GPIO_B, 16}, {GPIO_B, 17}, {GPIO_D,  0}, {GPIO_A, 12},   //  0 -  3
+  {GPIO_A, 13}, {GPIO_D,  7}, {GPIO_D,  4}, {GPIO_D,  2},   //  4 -  7
+  {GPIO_D,  3}, {GPIO_C,  3}, {GPIO_C,  4}, {GPIO_C,  6},   //  8 - 11
+  {GPIO_C,  7}, {GPIO_C,  5}, {GPIO_D,  1}, {GPIO_C,  0},   // 12 - 15
+  {GPIO_B,  0}, {GPIO_B,  1}, {GPIO_B,  3}, {GPIO_B,  2},   // 16 - 19
+  {GPIO_D,  5}, {GPIO_D,  6}, {GPIO_C,  1}, {GPIO_C,  2},   // 20 - 23
+  {GPIO_E, 26}, {GPIO_A,  5}, {GPIO_A, 14}, {GPIO_A, 15},   // 24 - 27
+  {GPIO_A, 16}, {GPIO_B, 18}, {GPIO_B, 19}, {GPIO_B, 10},   // 28 - 31
+  {GPIO_B, 11}, {GPIO_E, 24}, {GPIO_E, 25}, {GPIO_C,  8},   // 32 - 35
+  {GPIO_C,  9}, {GPIO_C, 10}, {GPIO_C, 11}, {GPIO_A, 17},   // 36 - 39
+};
+
+#define NUM_MAPPED_PINS     (sizeof (pin_map) / sizeof (pin_map[0]))
+
+constexpr int pin_port (int pin)
+{
+  return pin_map[pin].port;
+}
+
+constexpr int pin_bit (int pin)
+{
+  return pin_map[pin].bit;
+}
+
+constexpr uint32_t pin_mask (int pin)
+{
+  return 1UL << pin_map[pin].bit;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# Poll the Teensy Blaster USB buffer pool telemetry during a programming run.
+#
+# Usage: blaster_pools.py [interval seconds] [--total]
+#        blaster_pools.py --watchdog
+#
+# Each line shows, for each pool, the buffers in use now as a bar scaled to the
+# pool size the device reports, then the high-water mark, usb_malloc() failures,
+# receive starvation events and frames spent starved since the previous line, or
+# since the start with --total. Requires pyusb.
+# The counters are read with vendor request 0xA1, which works while Quartus has
+# the Blaster open, as it only uses the control endpoint.
+#
+# With --watchdog, print the state recorded when the USB watchdog last fired,
+# read with vendor request 0xA2.
+
+import struct
+import sys
+import time
+
+import usb.core
+
+VENDOR_ID = 0x09FB
+PRODUCT_ID = 0x6001
+POOLS = ('EP1 (TX)', 'EP2 (RX)', 'Shared')
+ENTRY = '<6I'
+BAR = 16                # Longest bar, for pools larger than this
+
+
+def read_stats(dev, clear):
+    data = dev.ctrl_transfer(0xC0, 0xA1, 1 if clear else 0, 0,
+                             struct.calcsize(ENTRY) * len(POOLS))
+    return [struct.unpack_from(ENTRY, data, i * struct.calcsize(ENTRY))
+            for i in range(len(POOLS))]
+
+
+def show_watchdog(dev):
+    n = len(POOLS) - 1
+    fmt = '<2I%dI%dI%dB%dB%dH%dH' % (6 * len(POOLS), 4 * (n + 1), n, n, n, n)
+    data = dev.ctrl_transfer(0xC0, 0xA2, 0, 0, struct.calcsize(fmt))
+    v = list(struct.unpack(fmt, bytes(data)))
+    trips, millis = v[0:2]
+    print('Watchdog fired %d times, last at %.3f s' % (trips, millis / 1000.0))
+    if trips == 0:
+        return
+    k = 2
+    for p in POOLS:
+        print('  %-9s used %2d of %2d high %2d fail %5d starve %5d frames %6d'
+              % ((p, v[k], v[k + 5]) + tuple(v[k + 1:k + 5])))
+        k += 6
+    for ep in range(n + 1):
+        print('  EP%d BDT  ' % ep + ' '.join('%08X' % d for d in v[k:k + 4]))
+        k += 4
+    for name in ('rx_memory_needed', 'tx_state', 'rx_packets', 'tx_packets'):
+        print('  %-17s' % name + ' '.join('%3d' % d for d in v[k:k + n]))
+        k += n
+
+
+def main():
+    interval = 0.5
+    clear = '--total' not in sys.argv
+    args = [a for a in sys.argv[1:] if a not in ('--total', '--watchdog')]
+    if args:
+        interval = float(args[0])
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if dev is None:
+        sys.exit('No Blaster found')
+    if '--watchdog' in sys.argv:
+        show_watchdog(dev)
+        return
+    print('time   ' + ''.join('%-38s' % p for p in POOLS))
+    t0 = time.time()
+    read_stats(dev, True)
+    while True:
+        time.sleep(interval)
+        line = '%6.1f ' % (time.time() - t0)
+        for used, high, fail, starve, frames, size in read_stats(dev, clear):
+            width = min(size, BAR)
+            full = min(width, (used * width + size - 1) // size) if size else 0
+            bar = '#' * full + '.' * (width - full)
+            line += '%-16s %2d f%-4d s%-4d %5dms ' % (bar, high, fail, starve, frames)
+        print(line, flush=True)
+
+
+if __name__ == '__main__':
+    main()
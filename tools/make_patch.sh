@@ -0,0 +1,32 @@
+#!/bin/sh
+# Regenerate teensy_blaster_arduino.patch from the modified Teensyduino files.
+#
+# Usage: tools/make_patch.sh <stock arduino folder>
+#
+# The stock folder is the "arduino" folder of an unmodified Teensyduino 1.52
+# install, or at least its hardware/teensy/avr/boards.txt and the cores/teensy3
+# files listed below. Run from the top of this repository after any change to
+# the files in the "arduino" folder.
+
+set -e
+
+if [ $# -ne 1 ] || [ ! -d "$1/hardware/teensy/avr" ]; then
+	echo "Usage: $0 <stock arduino folder>" >&2
+	exit 2
+fi
+
+FILES="hardware/teensy/avr/boards.txt
+hardware/teensy/avr/cores/teensy3/usb_desc.c
+hardware/teensy/avr/cores/teensy3/usb_desc.h
+hardware/teensy/avr/cores/teensy3/usb_dev.c
+hardware/teensy/avr/cores/teensy3/usb_dev.h
+hardware/teensy/avr/cores/teensy3/usb_mem.c
+hardware/teensy/avr/cores/teensy3/usb_mem.h
+hardware/teensy/avr/cores/teensy3/yield.cpp"
+
+: > teensy_blaster_arduino.patch
+for f in $FILES; do
+	# diff exits with 1 when the files differ
+	diff -uNb --label "arduino.orig/$f" --label "arduino/$f" "$1/$f" "arduino/$f" \
+		| sed "1i diff -uNrb arduino.orig/$f arduino/$f" >> teensy_blaster_arduino.patch || true
+done